@@ -0,0 +1,151 @@
+// Times collision-avoidance neighbor search for fleets of 100 to 10,000
+// robots: building the spatial hash and querying every robot's neighbors,
+// against the all-pairs check it replaces, and the formation controller tick
+// with avoidance on and off. Robots are scattered at a constant density of
+// one per 700 mm square, so each has a handful of neighbors in range, and
+// each one's formation target is a little way ahead of it so the whole fleet
+// is driving (a robot turning on the spot is never checked for collisions).
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bench/bench_util.h"
+#include "src/clock.h"
+#include "src/formation.h"
+#include "src/spatial_hash.h"
+
+static const float kSpacingMm = 700.0f;
+// How far ahead of each robot its target is, and up to how far to the side.
+// Small enough sideways that the control law drives rather than spins.
+static const float kTargetAheadMm = 1000.0f;
+static const float kTargetSideMm = 200.0f;
+
+static void Scatter(size_t n, std::vector<float>* x, std::vector<float>* y,
+                    std::vector<float>* theta) {
+  uint32_t side = uint32_t(std::sqrt(double(n)) * kSpacingMm);
+  uint32_t seed = 1;
+  x->resize(n);
+  y->resize(n);
+  theta->resize(n);
+  for (size_t i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    (*x)[i] = float(seed % side);
+    seed = seed * 1103515245 + 12345;
+    (*y)[i] = float(seed % side);
+    seed = seed * 1103515245 + 12345;
+    (*theta)[i] = float(seed % 6283) / 1000.0f;
+  }
+}
+
+static size_t CountPairsHashed(const std::vector<float>& x,
+                               const std::vector<float>& y, float radius,
+                               SpatialHash* hash,
+                               std::vector<uint32_t>* neighbors) {
+  hash->Build(x.data(), y.data(), x.size(), radius);
+  size_t pairs = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    neighbors->clear();
+    // Every robot finds itself too.
+    pairs += hash->QueryRadius(x[i], y[i], radius, neighbors) - 1;
+  }
+  return pairs / 2;
+}
+
+static size_t CountPairsNaive(const std::vector<float>& x,
+                              const std::vector<float>& y, float radius) {
+  size_t pairs = 0;
+  float radius_sq = radius * radius;
+  for (size_t i = 0; i < x.size(); i++) {
+    for (size_t j = i + 1; j < x.size(); j++) {
+      float dx = x[j] - x[i];
+      float dy = y[j] - y[i];
+      if (dx * dx + dy * dy <= radius_sq) {
+        pairs++;
+      }
+    }
+  }
+  return pairs;
+}
+
+int main(int argc, char* argv[]) {
+  int num_ticks = 200;
+  float radius = 500.0f;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+      num_ticks = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--radius-mm") == 0 && i + 1 < argc) {
+      radius = float(std::atof(argv[++i]));
+    } else {
+      printf("Usage: %s [--ticks N] [--radius-mm N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  const size_t fleet_sizes[] = {100, 1000, 5000, 10000};
+  bool all_match = true;
+  for (size_t n : fleet_sizes) {
+    std::vector<float> x, y, theta;
+    Scatter(n, &x, &y, &theta);
+
+    SpatialHash hash;
+    std::vector<uint32_t> neighbors;
+    size_t pairs = 0;
+    std::vector<int64_t> hashed_ns, naive_ns;
+    for (int t = 0; t < num_ticks; t++) {
+      uint64_t start = NowNs();
+      pairs = CountPairsHashed(x, y, radius, &hash, &neighbors);
+      hashed_ns.push_back(int64_t(NowNs() - start));
+    }
+
+    // All-pairs gets slow quickly; a few ticks is plenty.
+    size_t naive_pairs = 0;
+    for (int t = 0; t < (n > 1000 ? 3 : num_ticks); t++) {
+      uint64_t start = NowNs();
+      naive_pairs = CountPairsNaive(x, y, radius);
+      naive_ns.push_back(int64_t(NowNs() - start));
+    }
+
+    FormationController formation;
+    formation.Resize(n);
+    for (size_t i = 0; i < n; i++) {
+      float c = std::cos(theta[i]);
+      float s = std::sin(theta[i]);
+      float side = kTargetSideMm * (float(i % 5) - 2.0f) / 2.0f;
+      formation.SetPose(i, x[i], y[i], theta[i]);
+      formation.SetActive(i, true);
+      formation.SetOffset(i, x[i] + kTargetAheadMm * c - side * s,
+                          y[i] + kTargetAheadMm * s + side * c);
+      formation.SetGains(i, 1.0f, 0.005f);
+    }
+    std::vector<int64_t> step_ns, avoid_ns;
+    for (int t = 0; t < num_ticks; t++) {
+      uint64_t start = NowNs();
+      formation.Step();
+      step_ns.push_back(int64_t(NowNs() - start));
+    }
+    formation.SetAvoidanceRadius(radius);
+    for (int t = 0; t < num_ticks; t++) {
+      uint64_t start = NowNs();
+      formation.Step();
+      avoid_ns.push_back(int64_t(NowNs() - start));
+    }
+
+    printf("%zu robots: %zu pairs within %.0f mm, %zu robots checked, %zu "
+           "avoiding\n",
+           n, pairs, radius, formation.GetNumQueried(),
+           formation.GetNumAvoiding());
+    if (pairs != naive_pairs) {
+      printf("  all-pairs found %zu pairs!\n", naive_pairs);
+      all_match = false;
+    }
+    PrintDistribution("  spatial hash", &hashed_ns);
+    PrintDistribution("  all pairs", &naive_ns);
+    PrintDistribution("  formation step", &step_ns);
+    PrintDistribution("  + avoidance", &avoid_ns);
+  }
+
+  return all_match ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Helpers shared by the benchmarks under bench/.
+
+// Opens a blocking TCP connection to 127.0.0.1:|port|. Returns -1 on failure.
+inline int ConnectLoopback(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(sock, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+// Prints min/percentiles/max of |samples_ns| in microseconds. Sorts in place.
+inline void PrintDistribution(const char* label,
+                              std::vector<int64_t>* samples_ns) {
+  if (samples_ns->empty()) {
+    printf("%-24s (no samples)\n", label);
+    return;
+  }
+
+  std::sort(samples_ns->begin(), samples_ns->end());
+  auto pct = [&](double p) {
+    size_t idx = size_t(p * double(samples_ns->size() - 1));
+    return double((*samples_ns)[idx]) / 1000.0;
+  };
+
+  printf("%-24s min %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  "
+         "max %8.1f us\n",
+         label, pct(0.0), pct(0.5), pct(0.9), pct(0.99), pct(0.999), pct(1.0));
+}
+
+#endif  // _BENCH_UTIL_H_
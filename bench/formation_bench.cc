@@ -0,0 +1,106 @@
+// Times one formation controller tick (control law plus Drive Direct
+// encoding) for fleets of 10 to 10,000 robots, with every kernel this build
+// and CPU support. Each kernel's wheel velocities are checked against the
+// scalar kernel's.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bench/bench_util.h"
+#include "src/clock.h"
+#include "src/formation.h"
+
+// Scatters the robots pseudo-randomly over a 20 m square, with a grid
+// formation of the same size centered in it.
+static void SetUpFleet(FormationController* formation, size_t n) {
+  formation->Resize(n);
+  size_t columns = size_t(std::ceil(std::sqrt(double(n))));
+  uint32_t seed = 1;
+  for (size_t i = 0; i < n; i++) {
+    seed = seed * 1103515245 + 12345;
+    float x = float(seed % 20000) - 10000.0f;
+    seed = seed * 1103515245 + 12345;
+    float y = float(seed % 20000) - 10000.0f;
+    seed = seed * 1103515245 + 12345;
+    float theta = float(seed % 6283) / 1000.0f;
+    formation->SetPose(i, x, y, theta);
+    formation->SetActive(i, true);
+    formation->SetOffset(i, float(i % columns) * 400.0f,
+                         float(i / columns) * 400.0f);
+    formation->SetGains(i, 1.0f, 0.005f);
+  }
+  formation->SetFormationPose(-200.0f * columns, -200.0f * columns, 0.3f);
+}
+
+static bool MatchesScalar(const FormationController& formation,
+                          const FormationController& scalar, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    // Kernels may round exact halves differently.
+    if (std::abs(formation.GetLeftVelocities()[i] -
+                 scalar.GetLeftVelocities()[i]) > 1 ||
+        std::abs(formation.GetRightVelocities()[i] -
+                 scalar.GetRightVelocities()[i]) > 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int num_ticks = 2000;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+      num_ticks = std::atoi(argv[++i]);
+    } else {
+      printf("Usage: %s [--ticks N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  const size_t fleet_sizes[] = {10, 100, 1000, 10000};
+  const FormationController::Kernel kernels[] = {
+      FormationController::kScalar, FormationController::kSse,
+      FormationController::kAvx, FormationController::kNeon};
+
+  bool all_match = true;
+  for (size_t n : fleet_sizes) {
+    FormationController scalar;
+    scalar.SetKernel(FormationController::kScalar);
+    SetUpFleet(&scalar, n);
+    scalar.Step();
+
+    for (FormationController::Kernel kernel : kernels) {
+      if (!FormationController::IsKernelSupported(kernel)) {
+        continue;
+      }
+
+      FormationController formation;
+      formation.SetKernel(kernel);
+      SetUpFleet(&formation, n);
+
+      std::vector<int64_t> tick_ns;
+      tick_ns.reserve(num_ticks);
+      for (int t = 0; t < num_ticks; t++) {
+        uint64_t start = NowNs();
+        formation.Step();
+        tick_ns.push_back(int64_t(NowNs() - start));
+      }
+
+      bool match = MatchesScalar(formation, scalar, n);
+      all_match &= match;
+
+      char label[64];
+      snprintf(label, sizeof(label), "%5zu robots, %-6s", n,
+               FormationController::GetKernelName(kernel));
+      PrintDistribution(label, &tick_ns);
+      if (!match) {
+        printf("  ^ wheel velocities differ from the scalar kernel!\n");
+      }
+    }
+  }
+
+  return all_match ? 0 : 1;
+}
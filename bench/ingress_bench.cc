@@ -0,0 +1,168 @@
+// Measures the shared-memory command ingress. A planner thread pushes a batch
+// of Drive Direct commands per tick through RoombaIngressClient and commits
+// it; we report the planner's cost per command, the time from Commit() until
+// the server has sent the whole batch, and overall commands per second. For
+// comparison the same batches are also sent with RoombaServer::Send(), the
+// in-process API a planner would otherwise have to link against.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "ingress/roomba_ingress.h"
+#include "src/clock.h"
+#include "src/roomba_oi.h"
+#include "src/roomba_server.h"
+
+// Reads and discards everything the server sends the fake roombas.
+static void DrainSockets(const std::vector<int>* sockets,
+                         std::atomic<bool>* running) {
+  std::vector<uint8_t> buf(65536);
+  while (running->load()) {
+    bool any = false;
+    for (int sock : *sockets) {
+      while (recv(sock, buf.data(), buf.size(), MSG_DONTWAIT) > 0) {
+        any = true;
+      }
+    }
+    if (!any) {
+      usleep(50);
+    }
+  }
+}
+
+static void WaitForCommands(RoombaServer* server, uint64_t expected) {
+  while (server->GetSendStats().commands < expected) {
+    std::this_thread::yield();
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint16_t port = 15444;
+  int num_clients = 16;
+  int per_tick = 4096;
+  int num_ticks = 500;
+  const char* path = "/tmp/roomba_ingress_bench.sock";
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = uint16_t(std::atoi(argv[++i]));
+    } else if (std::strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+      num_clients = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--per-tick") == 0 && i + 1 < argc) {
+      per_tick = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+      num_ticks = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else {
+      printf("Usage: %s [--port N] [--clients N] [--per-tick N] [--ticks N] "
+             "[--path SOCKET]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  RoombaServer server;
+  server.SetSerialBaud(0);
+  server.SetHelloTimeout(0);
+  server.SetIngressPath(path);
+  server.SetTickBatching(true);
+  if (!server.Initialize(port)) {
+    printf("Failed to start the roomba server.\n");
+    return 1;
+  }
+
+  std::vector<int> sockets;
+  for (int i = 0; i < num_clients; i++) {
+    int sock = ConnectLoopback(port);
+    if (sock < 0) {
+      printf("Failed to connect fake roomba %d.\n", i);
+      return 1;
+    }
+    sockets.push_back(sock);
+  }
+  while (server.GetNumClients() < size_t(num_clients)) {
+    usleep(1000);
+  }
+
+  std::atomic<bool> running(true);
+  std::thread drain_thread(DrainSockets, &sockets, &running);
+
+  RoombaIngressClient ingress;
+  if (!ingress.Connect(path)) {
+    return 1;
+  }
+
+  uint8_t drive[5];
+  oi::EncodeDriveDirect(200, -200, drive);
+
+  // Shared memory ingress.
+  std::vector<int64_t> push_ns, drain_ns;
+  uint64_t expected = server.GetSendStats().commands;
+  uint64_t start = NowNs();
+  for (int t = 0; t < num_ticks; t++) {
+    uint64_t push_start = NowNs();
+    for (int c = 0; c < per_tick; c++) {
+      while (!ingress.Push(uint16_t(c % num_clients), drive, sizeof(drive))) {
+        // Ring full: let the server catch up.
+        ingress.Commit();
+        std::this_thread::yield();
+      }
+    }
+    uint64_t commit = NowNs();
+    push_ns.push_back(int64_t(commit - push_start));
+    if (!ingress.Commit()) {
+      printf("Lost the ingress connection.\n");
+      return 1;
+    }
+
+    expected += per_tick;
+    WaitForCommands(&server, expected);
+    drain_ns.push_back(int64_t(NowNs() - commit));
+  }
+  double ingress_s = double(NowNs() - start) / 1e9;
+
+  // The same batches through the in-process API.
+  std::vector<int64_t> send_ns;
+  start = NowNs();
+  for (int t = 0; t < num_ticks; t++) {
+    uint64_t tick_start = NowNs();
+    for (int c = 0; c < per_tick; c++) {
+      server.Send(size_t(c % num_clients), drive, sizeof(drive));
+    }
+    server.FlushTick();
+    send_ns.push_back(int64_t(NowNs() - tick_start));
+  }
+  double send_s = double(NowNs() - start) / 1e9;
+
+  uint64_t total = uint64_t(num_ticks) * per_tick;
+  int64_t total_push_ns = 0;
+  for (int64_t ns : push_ns) {
+    total_push_ns += ns;
+  }
+  printf("%d ticks of %d commands to %d roombas\n", num_ticks, per_tick,
+         num_clients);
+  printf("ingress: %.2f M commands/s, %.1f ns to push a command\n",
+         double(total) / ingress_s / 1e6,
+         double(total_push_ns) / double(total));
+  PrintDistribution("  push batch", &push_ns);
+  PrintDistribution("  commit to sent", &drain_ns);
+  printf("Send(): %.2f M commands/s\n", double(total) / send_s / 1e6);
+  PrintDistribution("  send batch", &send_ns);
+
+  ingress.Close();
+  running = false;
+  drain_thread.join();
+  server.Shutdown();
+  for (int sock : sockets) {
+    close(sock);
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Measures intended-vs-actual send time for a periodic command stream.
+//
+// Starts a RoombaServer on the loopback interface, connects a number of fake
+// roombas to it, and broadcasts a Drive Direct frame from a ControlLoop every
+// period. For each tick we record how late the loop woke up and how late the
+// broadcast finished relative to the tick's deadline. Run it once plain and
+// once with --rt-cpu/--rt-priority/--mlock for the server worker and
+// --control-cpu/--control-priority for the loop, as MasterServer takes them,
+// to compare.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "src/clock.h"
+#include "src/control_loop.h"
+#include "src/realtime.h"
+#include "src/roomba_server.h"
+
+int main(int argc, char* argv[]) {
+  uint16_t port = 14440;
+  uint32_t period_us = 20000;
+  uint32_t num_ticks = 500;
+  int num_clients = 4;
+  RealtimeConfig rt_config;
+  RealtimeConfig control_rt_config;
+
+  for (int i = 1; i < argc; i++) {
+    if (ParseRealtimeFlag(argc, argv, &i, &rt_config)) {
+      continue;
+    } else if (!std::strcmp(argv[i], "--control-cpu") && i + 1 < argc) {
+      control_rt_config.cpu = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--control-priority") && i + 1 < argc) {
+      control_rt_config.priority = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--period-us") && i + 1 < argc) {
+      period_us = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--ticks") && i + 1 < argc) {
+      num_ticks = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--clients") && i + 1 < argc) {
+      num_clients = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--port") && i + 1 < argc) {
+      port = std::atoi(argv[++i]);
+    } else {
+      printf("Usage: %s [--period-us N] [--ticks N] [--clients N] "
+             "[--port N] [--control-cpu N] [--control-priority N] "
+             "[--rt-cpu N] [--rt-priority N] [--mlock]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  RoombaServer server;
+  server.SetRealtimeConfig(rt_config);
+  if (!server.Initialize(port)) {
+    printf("Failed to start the roomba server.\n");
+    return 1;
+  }
+
+  std::vector<int> sockets;
+  for (int i = 0; i < num_clients; i++) {
+    int sock = ConnectLoopback(port);
+    if (sock < 0) {
+      printf("Failed to connect fake roomba %d.\n", i);
+      return 1;
+    }
+    sockets.push_back(sock);
+  }
+
+  while (server.GetNumClients() < size_t(num_clients)) {
+    usleep(1000);
+  }
+
+  std::mutex samples_mutex;
+  std::vector<int64_t> wake_lateness, send_lateness;
+  wake_lateness.reserve(num_ticks);
+  send_lateness.reserve(num_ticks);
+
+  // Drive Direct, 100 mm/s on both wheels.
+  unsigned char frame[] = {0x91, 0x00, 0x64, 0x00, 0x64};
+
+  ControlLoop loop;
+  loop.Start(period_us,
+             [&](uint64_t, uint64_t deadline_ns) {
+               uint64_t woke = NowNs();
+               server.Broadcast(frame, sizeof(frame));
+               uint64_t sent = NowNs();
+
+               std::lock_guard<std::mutex> lock(samples_mutex);
+               wake_lateness.push_back(int64_t(woke - deadline_ns));
+               send_lateness.push_back(int64_t(sent - deadline_ns));
+             },
+             control_rt_config);
+
+  // Drain the fake roombas so their receive buffers never fill.
+  std::vector<char> sink(4096);
+  while (loop.GetNumTicks() < num_ticks) {
+    for (int sock : sockets) {
+      recv(sock, sink.data(), sink.size(), MSG_DONTWAIT);
+    }
+    usleep(period_us / 4);
+  }
+  loop.Stop();
+
+  printf("%u ticks at %u us, %d clients, %llu overruns\n", num_ticks,
+         period_us, num_clients, (unsigned long long)loop.GetNumOverruns());
+  std::lock_guard<std::mutex> lock(samples_mutex);
+  PrintDistribution("wakeup lateness", &wake_lateness);
+  PrintDistribution("send lateness", &send_lateness);
+
+  for (int sock : sockets) {
+    close(sock);
+  }
+  server.Shutdown();
+  return 0;
+}
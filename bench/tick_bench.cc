@@ -0,0 +1,164 @@
+// Compares immediate and tick-batched sends.
+//
+// Each tick issues Safe, Drive Direct and LEDs to every roomba, then ends the
+// tick with FlushTick(). We report write() syscalls and TCP segments per tick
+// (from the server's counters) and end-of-tick latency: the time from the
+// start of the tick until a fake roomba has received all of its commands.
+// With --trace-sample each mode also dumps a Chrome trace of its commands.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "src/clock.h"
+#include "src/roomba_oi.h"
+#include "src/roomba_server.h"
+
+static bool RunMode(bool batching, uint16_t port, int num_clients,
+                    int num_ticks, uint32_t period_us, int trace_sample,
+                    const char* trace_path) {
+  RoombaServer server;
+  server.SetTraceSampling(trace_sample);
+  if (!server.Initialize(port)) {
+    printf("Failed to start the roomba server.\n");
+    return false;
+  }
+
+  std::vector<int> sockets;
+  for (int i = 0; i < num_clients; i++) {
+    int sock = ConnectLoopback(port);
+    if (sock < 0) {
+      printf("Failed to connect fake roomba %d.\n", i);
+      return false;
+    }
+    sockets.push_back(sock);
+  }
+
+  while (server.GetNumClients() < size_t(num_clients)) {
+    usleep(1000);
+  }
+
+  // Swallow the start sequence sent on connect.
+  uint8_t start[32];
+  size_t start_len = oi::EncodeStartSequence(start);
+  std::vector<uint8_t> buf(4096);
+  for (int sock : sockets) {
+    size_t got = 0;
+    while (got < start_len) {
+      got += recv(sock, buf.data(), start_len - got, 0);
+    }
+  }
+
+  server.SetTickBatching(batching);
+
+  const uint8_t safe[] = {oi::kSafe};
+  uint8_t drive[5];
+  oi::EncodeDriveDirect(200, 200, drive);
+  const uint8_t leds[] = {oi::kLeds, 0x08, 0x00, 0xff};
+  const size_t tick_bytes = sizeof(safe) + sizeof(drive) + sizeof(leds);
+
+  std::vector<int64_t> latency;
+  latency.reserve(size_t(num_ticks) * num_clients);
+
+  SendStats before = server.GetSendStats();
+  for (int tick = 0; tick < num_ticks; tick++) {
+    uint64_t tick_start = NowNs();
+    for (int slot = 0; slot < num_clients; slot++) {
+      server.Send(slot, safe, sizeof(safe));
+      server.Send(slot, drive, sizeof(drive));
+      server.Send(slot, leds, sizeof(leds));
+    }
+    server.FlushTick();
+
+    // Read up to the tick's last command rather than counting bytes, so
+    // anything else the server sent (the drive command after the start
+    // sequence, say) can't make us stop early.
+    for (int sock : sockets) {
+      size_t got = 0;
+      while (got < tick_bytes ||
+             std::memcmp(buf.data() + got - sizeof(leds), leds,
+                         sizeof(leds)) != 0) {
+        if (got == buf.size()) {
+          printf("Fake roomba never got the end of the tick.\n");
+          return false;
+        }
+        ssize_t ret = recv(sock, buf.data() + got, buf.size() - got, 0);
+        if (ret <= 0) {
+          printf("Fake roomba lost its connection.\n");
+          return false;
+        }
+        got += ret;
+      }
+      latency.push_back(int64_t(NowNs() - tick_start));
+    }
+
+    usleep(period_us);
+  }
+  SendStats after = server.GetSendStats();
+
+  double per_tick = double(num_ticks);
+  printf("%s mode, %d roombas, %d ticks\n",
+         batching ? "tick-batched" : "immediate", num_clients, num_ticks);
+  printf("  commands/tick %8.1f  write()s/tick %8.1f  segments/tick %8.1f\n",
+         (after.commands - before.commands) / per_tick,
+         (after.write_calls - before.write_calls) / per_tick,
+         (after.segments - before.segments) / per_tick);
+  printf("  paced holds %llu  coalesced %llu  drops %llu\n",
+         (unsigned long long)(after.paced_holds - before.paced_holds),
+         (unsigned long long)(after.paced_coalesced - before.paced_coalesced),
+         (unsigned long long)(after.paced_drops - before.paced_drops));
+  PrintDistribution("  end-of-tick latency", &latency);
+
+  if (trace_sample > 0) {
+    // Give the last acknowledgements a moment to be polled.
+    usleep(10000);
+    server.DumpTrace(trace_path);
+    printf("  wrote command trace to %s\n", trace_path);
+  }
+
+  for (int sock : sockets) {
+    close(sock);
+  }
+  server.Shutdown();
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  uint16_t port = 14450;
+  int num_clients = 8;
+  int num_ticks = 200;
+  uint32_t period_us = 20000;
+  int trace_sample = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!std::strcmp(argv[i], "--clients") && i + 1 < argc) {
+      num_clients = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--ticks") && i + 1 < argc) {
+      num_ticks = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--period-us") && i + 1 < argc) {
+      period_us = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--port") && i + 1 < argc) {
+      port = std::atoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--trace-sample") && i + 1 < argc) {
+      trace_sample = std::atoi(argv[++i]);
+    } else {
+      printf("Usage: %s [--clients N] [--ticks N] [--period-us N] [--port N] "
+             "[--trace-sample N]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  if (!RunMode(false, port, num_clients, num_ticks, period_us, trace_sample,
+               "tick_bench_immediate.json") ||
+      !RunMode(true, port + 1, num_clients, num_ticks, period_us, trace_sample,
+               "tick_bench_batched.json")) {
+    return 1;
+  }
+  return 0;
+}
@@ -31,3 +31,7 @@ set(CMAKE_FIND_ROOT_PATH ${FIND_ROOT})
 set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)
 set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)
 set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)
+
+# The Bebop's Cortex-A9 has NEON; the formation controller's kernels use it.
+set(CMAKE_C_FLAGS_INIT "-mfpu=neon -mfloat-abi=hard")
+set(CMAKE_CXX_FLAGS_INIT "-mfpu=neon -mfloat-abi=hard")
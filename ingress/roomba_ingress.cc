@@ -0,0 +1,170 @@
+#include "ingress/roomba_ingress.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "src/fd_passing.h"
+
+bool RoombaIngressClient::Connect(const char* socket_path) {
+  Close();
+
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(socket_path) >= sizeof(addr.sun_path)) {
+    printf("Ingress socket path %s is too long.\n", socket_path);
+    return false;
+  }
+  std::strcpy(addr.sun_path, socket_path);
+
+  socket_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (socket_ < 0 || connect(socket_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    printf("Failed to connect to %s, errno = %s\n", socket_path,
+           strerror(errno));
+    Close();
+    return false;
+  }
+
+  ShmHello hello;
+  int fds[2] = {-1, -1};
+  size_t num_fds = 0;
+  ssize_t len = RecvWithFds(socket_, &hello, sizeof(hello), fds, 2, &num_fds);
+  if (len != ssize_t(sizeof(hello)) || num_fds != 2 ||
+      hello.magic != kShmRingMagic || hello.version != kShmRingVersion) {
+    printf("Unexpected hello from the roomba server.\n");
+    for (size_t i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    Close();
+    return false;
+  }
+
+  doorbell_ = fds[1];
+  void* map = mmap(nullptr, ShmRingMapSize(hello.capacity),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (map == MAP_FAILED) {
+    printf("Failed to map the command ring, errno = %s\n", strerror(errno));
+    Close();
+    return false;
+  }
+
+  ring_ = static_cast<ShmRingHeader*>(map);
+  data_ = ShmRingData(ring_);
+  capacity_ = hello.capacity;
+  head_ = ring_->head.load(std::memory_order_relaxed);
+  cached_tail_ = ring_->tail.load(std::memory_order_acquire);
+  return true;
+}
+
+void RoombaIngressClient::Close() {
+  if (ring_ != nullptr) {
+    munmap(ring_, ShmRingMapSize(capacity_));
+    ring_ = nullptr;
+    data_ = nullptr;
+  }
+
+  if (doorbell_ != -1) {
+    close(doorbell_);
+    doorbell_ = -1;
+  }
+
+  if (socket_ != -1) {
+    close(socket_);
+    socket_ = -1;
+  }
+}
+
+size_t RoombaIngressClient::GetFreeBytes() {
+  cached_tail_ = ring_->tail.load(std::memory_order_acquire);
+  return size_t(capacity_ - (head_ - cached_tail_));
+}
+
+bool RoombaIngressClient::Push(uint16_t slot, const void* data, size_t len) {
+  if (len > kShmMaxFrameBytes || slot == kShmTargetPadding ||
+      slot == kShmTargetId) {
+    return false;
+  }
+  return PushRecord(slot, nullptr, 0, data, len);
+}
+
+bool RoombaIngressClient::PushToId(const char* id, const void* data,
+                                   size_t len) {
+  size_t id_len = std::strlen(id);
+  if (len > kShmMaxFrameBytes || id_len == 0 || id_len > kShmMaxIdBytes) {
+    return false;
+  }
+  return PushRecord(kShmTargetId, id, id_len, data, len);
+}
+
+bool RoombaIngressClient::PushRecord(uint16_t target, const char* id,
+                                     size_t id_len, const void* data,
+                                     size_t len) {
+  if (ring_ == nullptr) {
+    return false;
+  }
+
+  size_t record_len = id != nullptr ? ShmIdRecordLen(id_len, len) : len;
+  size_t size = ShmRecordSize(record_len);
+  size_t offset = size_t(head_ & (capacity_ - 1));
+  size_t to_end = capacity_ - offset;
+  size_t padding = size > to_end ? to_end : 0;
+
+  // Only look at the server's tail when our cached copy says we're full.
+  if (head_ + padding + size - cached_tail_ > capacity_ &&
+      GetFreeBytes() < padding + size) {
+    return false;
+  }
+
+  if (padding != 0) {
+    ShmRecord pad = {kShmTargetPadding, 0};
+    std::memcpy(data_ + offset, &pad, sizeof(pad));
+    head_ += padding;
+    offset = 0;
+  }
+
+  ShmRecord record = {target, uint16_t(record_len)};
+  uint8_t* out = data_ + offset;
+  std::memcpy(out, &record, sizeof(record));
+  out += sizeof(record);
+  if (id != nullptr) {
+    *out++ = uint8_t(id_len);
+    std::memcpy(out, id, id_len);
+    out += id_len;
+  }
+  std::memcpy(out, data, len);
+  head_ += size;
+  return true;
+}
+
+bool RoombaIngressClient::Commit() {
+  if (ring_ == nullptr) {
+    return false;
+  }
+
+  // The server closes our socket when it drops us or shuts down.
+  pollfd pfd = {socket_, POLLRDHUP, 0};
+  int ready;
+  do {
+    ready = poll(&pfd, 1, 0);
+  } while (ready < 0 && errno == EINTR);
+  if (ready > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+    Close();
+    return false;
+  }
+
+  if (ring_->head.load(std::memory_order_relaxed) == head_) {
+    return true;
+  }
+
+  ring_->head.store(head_, std::memory_order_release);
+  uint64_t one = 1;
+  return write(doorbell_, &one, sizeof(one)) == ssize_t(sizeof(one));
+}
@@ -0,0 +1,67 @@
+#ifndef _ROOMBA_INGRESS_H_
+#define _ROOMBA_INGRESS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "src/shm_ring.h"
+
+// Planner-side client for the MasterServer's shared-memory command ingress
+// (see src/shm_ingress.h). Link against the RoombaIngress library.
+//
+//   RoombaIngressClient ingress;
+//   ingress.Connect("/run/roomba_ingress.sock");
+//   for (each roomba) ingress.PushToId("roomba-1", frame, frame_len);
+//   ingress.Commit();  // once per tick
+//
+// Push() only writes shared memory; Commit() publishes everything pushed
+// since the last commit for two syscalls (a hangup check and the doorbell),
+// however many commands that is. Not thread safe: use one client per
+// producing thread.
+class RoombaIngressClient {
+ public:
+  ~RoombaIngressClient() { Close(); }
+
+  // Connects to the server's ingress socket and maps the ring it hands out.
+  bool Connect(const char* socket_path);
+  void Close();
+  bool IsConnected() const { return ring_ != nullptr; }
+
+  // Queues |data| for the roomba in client slot |slot|, or for every roomba
+  // with kShmTargetBroadcast. Returns false if |len| exceeds
+  // kShmMaxFrameBytes or the ring is full (Commit() and try again once the
+  // server has caught up).
+  bool Push(uint16_t slot, const void* data, size_t len);
+  // Queues |data| for the roomba with session id |id| (see
+  // roomba_identity.h), wherever it is connected by the time the server gets
+  // to it; dropped if no such roomba is connected or waiting to reconnect.
+  // Slots are reused as roombas come and go, so prefer this whenever the
+  // fleet is identified. Returns false as Push() does, or if |id| is empty
+  // or longer than kShmMaxIdBytes.
+  bool PushToId(const char* id, const void* data, size_t len);
+
+  // Publishes the pushed commands to the server and rings its doorbell.
+  // Returns false if the server has gone away.
+  bool Commit();
+
+  // Bytes of ring space still free, counting uncommitted commands.
+  size_t GetFreeBytes();
+
+ private:
+  // Writes a record, with |id| in front of |data| if it isn't null.
+  bool PushRecord(uint16_t target, const char* id, size_t id_len,
+                  const void* data, size_t len);
+
+  int socket_ = -1;
+  int doorbell_ = -1;
+  ShmRingHeader* ring_ = nullptr;
+  uint8_t* data_ = nullptr;
+  uint32_t capacity_ = 0;
+
+  // Our head, ahead of the published one by whatever isn't committed yet,
+  // and the last tail we read from the server.
+  uint64_t head_ = 0;
+  uint64_t cached_tail_ = 0;
+};
+
+#endif  // _ROOMBA_INGRESS_H_
@@ -0,0 +1,22 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <cstdint>
+#include <ctime>
+
+// Monotonic clock in nanoseconds. All scheduling and latency measurements in
+// the master use this clock so timestamps from different threads compare.
+inline uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+inline timespec NsToTimespec(uint64_t ns) {
+  timespec ts;
+  ts.tv_sec = time_t(ns / 1000000000ull);
+  ts.tv_nsec = long(ns % 1000000000ull);
+  return ts;
+}
+
+#endif  // _CLOCK_H_
@@ -0,0 +1,60 @@
+#include "control_loop.h"
+
+#include <cerrno>
+#include <ctime>
+
+#include "clock.h"
+
+bool ControlLoop::Start(uint32_t period_us, TickFn fn,
+                        const RealtimeConfig& rt) {
+  if (running_ || period_us == 0 || !fn) {
+    return false;
+  }
+
+  period_ns_ = uint64_t(period_us) * 1000;
+  tick_fn_ = fn;
+  rt_config_ = rt;
+  num_ticks_ = 0;
+  num_overruns_ = 0;
+
+  running_ = true;
+  thread_ = std::thread(&ControlLoop::ThreadFn, this);
+  return true;
+}
+
+void ControlLoop::Stop() {
+  if (!running_) {
+    return;
+  }
+
+  running_ = false;
+  thread_.join();
+}
+
+void ControlLoop::ThreadFn() {
+  if (rt_config_.IsEnabled()) {
+    ApplyRealtimeConfig(rt_config_);
+  }
+
+  uint64_t deadline = NowNs() + period_ns_;
+  uint64_t tick = 0;
+  while (running_) {
+    timespec ts = NsToTimespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+           EINTR) {
+    }
+
+    tick_fn_(tick++, deadline);
+    num_ticks_++;
+
+    // Advance to the next deadline, dropping any we've already blown past.
+    deadline += period_ns_;
+    uint64_t now = NowNs();
+    if (now > deadline) {
+      uint64_t missed = (now - deadline) / period_ns_ + 1;
+      num_overruns_ += missed;
+      deadline += missed * period_ns_;
+      tick += missed;
+    }
+  }
+}
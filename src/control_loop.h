@@ -0,0 +1,41 @@
+#ifndef _CONTROL_LOOP_H_
+#define _CONTROL_LOOP_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#include "realtime.h"
+
+// Fixed-rate scheduler thread. Calls a tick function every |period_us|,
+// sleeping to absolute deadlines so that lateness in one tick doesn't push
+// every later tick back. If a tick overruns by more than a whole period the
+// missed ticks are skipped (and counted) rather than run back to back.
+class ControlLoop {
+ public:
+  // |tick| is the tick index, |deadline_ns| the intended start time of this
+  // tick on the NowNs() clock.
+  typedef std::function<void(uint64_t tick, uint64_t deadline_ns)> TickFn;
+
+  bool Start(uint32_t period_us, TickFn fn,
+             const RealtimeConfig& rt = RealtimeConfig());
+  void Stop();
+
+  uint64_t GetNumTicks() const { return num_ticks_.load(); }
+  uint64_t GetNumOverruns() const { return num_overruns_.load(); }
+
+ private:
+  void ThreadFn();
+
+  uint64_t period_ns_ = 0;
+  TickFn tick_fn_;
+  RealtimeConfig rt_config_;
+
+  std::atomic<bool> running_{false};
+  std::atomic<uint64_t> num_ticks_{0};
+  std::atomic<uint64_t> num_overruns_{0};
+  std::thread thread_;
+};
+
+#endif  // _CONTROL_LOOP_H_
@@ -0,0 +1,86 @@
+#include "fd_passing.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <sys/socket.h>
+
+bool SendWithFds(int channel, const void* data, size_t len, const int* fds,
+                 size_t num_fds) {
+  iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = len;
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * num_fds));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (num_fds > 0) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+  }
+
+  ssize_t ret;
+  do {
+    // A peer that died must fail the send, not kill us with SIGPIPE.
+    ret = sendmsg(channel, &msg, MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret != ssize_t(len)) {
+    printf("Failed to send message, errno = %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+ssize_t RecvWithFds(int channel, void* data, size_t len, int* fds,
+                    size_t max_fds, size_t* num_fds) {
+  iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = len;
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  ssize_t ret;
+  do {
+    ret = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+  } while (ret < 0 && errno == EINTR);
+
+  *num_fds = 0;
+  if (ret < 0) {
+    printf("Failed to receive message, errno = %s\n", strerror(errno));
+    return ret;
+  }
+
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+      *num_fds = n;
+    }
+  }
+
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    printf("Received message was truncated!\n");
+    return -1;
+  }
+
+  return ret;
+}
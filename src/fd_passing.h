@@ -0,0 +1,20 @@
+#ifndef _FD_PASSING_H_
+#define _FD_PASSING_H_
+
+#include <cstddef>
+
+#include <sys/types.h>
+
+// Sends |len| bytes over the Unix socket |channel| with |num_fds| file
+// descriptors attached as SCM_RIGHTS. Our copies of the descriptors stay
+// open.
+bool SendWithFds(int channel, const void* data, size_t len, const int* fds,
+                 size_t num_fds);
+
+// Receives one message into |data| and up to |max_fds| descriptors (opened
+// close-on-exec) into |fds|, setting |num_fds|. Returns the message length,
+// or -1 on failure or truncation.
+ssize_t RecvWithFds(int channel, void* data, size_t len, int* fds,
+                    size_t max_fds, size_t* num_fds);
+
+#endif  // _FD_PASSING_H_
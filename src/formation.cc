@@ -0,0 +1,434 @@
+#include "formation.h"
+
+#include "roomba_oi.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FORMATION_HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FORMATION_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Arrays are padded to this many lanes so every kernel can run whole vectors.
+const size_t kPadding = 8;
+
+// Top speed of a Create 2 wheel in mm/s.
+const float kMaxWheelSpeed = 500.0f;
+
+struct KernelArgs {
+  const float* x;
+  const float* y;
+  const float* cos;
+  const float* sin;
+  const float* offset_x;
+  const float* offset_y;
+  const float* kv;
+  const float* kw;
+  float center_x, center_y;
+  float heading_cos, heading_sin;
+  float half_base;
+  float arrive_sq;
+  int16_t* left;
+  int16_t* right;
+  size_t n;  // padded
+};
+
+void StepScalar(const KernelArgs& a) {
+  for (size_t i = 0; i < a.n; i++) {
+    float tx = a.center_x + a.heading_cos * a.offset_x[i] -
+               a.heading_sin * a.offset_y[i];
+    float ty = a.center_y + a.heading_sin * a.offset_x[i] +
+               a.heading_cos * a.offset_y[i];
+    float ex = tx - a.x[i];
+    float ey = ty - a.y[i];
+    float fwd = a.cos[i] * ex + a.sin[i] * ey;
+    float lat = a.cos[i] * ey - a.sin[i] * ex;
+
+    float v = a.kv[i] * fwd;
+    float w = a.kw[i] * lat;
+    if (fwd * fwd + lat * lat < a.arrive_sq) {
+      v = 0.0f;
+      w = 0.0f;
+    }
+
+    v = std::min(std::max(v, -kMaxWheelSpeed), kMaxWheelSpeed);
+    float r = v + w * a.half_base;
+    float l = v - w * a.half_base;
+    r = std::min(std::max(r, -kMaxWheelSpeed), kMaxWheelSpeed);
+    l = std::min(std::max(l, -kMaxWheelSpeed), kMaxWheelSpeed);
+    a.right[i] = int16_t(std::lrint(r));
+    a.left[i] = int16_t(std::lrint(l));
+  }
+}
+
+#ifdef FORMATION_HAVE_X86
+void StepSse(const KernelArgs& a) {
+  const __m128 cx = _mm_set1_ps(a.center_x);
+  const __m128 cy = _mm_set1_ps(a.center_y);
+  const __m128 hc = _mm_set1_ps(a.heading_cos);
+  const __m128 hs = _mm_set1_ps(a.heading_sin);
+  const __m128 half_base = _mm_set1_ps(a.half_base);
+  const __m128 arrive_sq = _mm_set1_ps(a.arrive_sq);
+  const __m128 max_speed = _mm_set1_ps(kMaxWheelSpeed);
+  const __m128 min_speed = _mm_set1_ps(-kMaxWheelSpeed);
+
+  for (size_t i = 0; i < a.n; i += 4) {
+    __m128 ox = _mm_loadu_ps(a.offset_x + i);
+    __m128 oy = _mm_loadu_ps(a.offset_y + i);
+    __m128 tx = _mm_add_ps(cx, _mm_sub_ps(_mm_mul_ps(hc, ox), _mm_mul_ps(hs, oy)));
+    __m128 ty = _mm_add_ps(cy, _mm_add_ps(_mm_mul_ps(hs, ox), _mm_mul_ps(hc, oy)));
+    __m128 ex = _mm_sub_ps(tx, _mm_loadu_ps(a.x + i));
+    __m128 ey = _mm_sub_ps(ty, _mm_loadu_ps(a.y + i));
+    __m128 c = _mm_loadu_ps(a.cos + i);
+    __m128 s = _mm_loadu_ps(a.sin + i);
+    __m128 fwd = _mm_add_ps(_mm_mul_ps(c, ex), _mm_mul_ps(s, ey));
+    __m128 lat = _mm_sub_ps(_mm_mul_ps(c, ey), _mm_mul_ps(s, ex));
+
+    __m128 arrived = _mm_cmplt_ps(
+        _mm_add_ps(_mm_mul_ps(fwd, fwd), _mm_mul_ps(lat, lat)), arrive_sq);
+    __m128 v = _mm_andnot_ps(arrived, _mm_mul_ps(_mm_loadu_ps(a.kv + i), fwd));
+    __m128 w = _mm_andnot_ps(arrived, _mm_mul_ps(_mm_loadu_ps(a.kw + i), lat));
+
+    v = _mm_min_ps(_mm_max_ps(v, min_speed), max_speed);
+    __m128 r = _mm_add_ps(v, _mm_mul_ps(w, half_base));
+    __m128 l = _mm_sub_ps(v, _mm_mul_ps(w, half_base));
+    r = _mm_min_ps(_mm_max_ps(r, min_speed), max_speed);
+    l = _mm_min_ps(_mm_max_ps(l, min_speed), max_speed);
+
+    __m128i r16 = _mm_packs_epi32(_mm_cvtps_epi32(r), _mm_setzero_si128());
+    __m128i l16 = _mm_packs_epi32(_mm_cvtps_epi32(l), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(a.right + i), r16);
+    _mm_storel_epi64((__m128i*)(a.left + i), l16);
+  }
+}
+
+__attribute__((target("avx"))) void StepAvx(const KernelArgs& a) {
+  const __m256 cx = _mm256_set1_ps(a.center_x);
+  const __m256 cy = _mm256_set1_ps(a.center_y);
+  const __m256 hc = _mm256_set1_ps(a.heading_cos);
+  const __m256 hs = _mm256_set1_ps(a.heading_sin);
+  const __m256 half_base = _mm256_set1_ps(a.half_base);
+  const __m256 arrive_sq = _mm256_set1_ps(a.arrive_sq);
+  const __m256 max_speed = _mm256_set1_ps(kMaxWheelSpeed);
+  const __m256 min_speed = _mm256_set1_ps(-kMaxWheelSpeed);
+
+  for (size_t i = 0; i < a.n; i += 8) {
+    __m256 ox = _mm256_loadu_ps(a.offset_x + i);
+    __m256 oy = _mm256_loadu_ps(a.offset_y + i);
+    __m256 tx = _mm256_add_ps(
+        cx, _mm256_sub_ps(_mm256_mul_ps(hc, ox), _mm256_mul_ps(hs, oy)));
+    __m256 ty = _mm256_add_ps(
+        cy, _mm256_add_ps(_mm256_mul_ps(hs, ox), _mm256_mul_ps(hc, oy)));
+    __m256 ex = _mm256_sub_ps(tx, _mm256_loadu_ps(a.x + i));
+    __m256 ey = _mm256_sub_ps(ty, _mm256_loadu_ps(a.y + i));
+    __m256 c = _mm256_loadu_ps(a.cos + i);
+    __m256 s = _mm256_loadu_ps(a.sin + i);
+    __m256 fwd = _mm256_add_ps(_mm256_mul_ps(c, ex), _mm256_mul_ps(s, ey));
+    __m256 lat = _mm256_sub_ps(_mm256_mul_ps(c, ey), _mm256_mul_ps(s, ex));
+
+    __m256 dist_sq =
+        _mm256_add_ps(_mm256_mul_ps(fwd, fwd), _mm256_mul_ps(lat, lat));
+    __m256 arrived = _mm256_cmp_ps(dist_sq, arrive_sq, _CMP_LT_OQ);
+    __m256 v = _mm256_andnot_ps(
+        arrived, _mm256_mul_ps(_mm256_loadu_ps(a.kv + i), fwd));
+    __m256 w = _mm256_andnot_ps(
+        arrived, _mm256_mul_ps(_mm256_loadu_ps(a.kw + i), lat));
+
+    v = _mm256_min_ps(_mm256_max_ps(v, min_speed), max_speed);
+    __m256 r = _mm256_add_ps(v, _mm256_mul_ps(w, half_base));
+    __m256 l = _mm256_sub_ps(v, _mm256_mul_ps(w, half_base));
+    r = _mm256_min_ps(_mm256_max_ps(r, min_speed), max_speed);
+    l = _mm256_min_ps(_mm256_max_ps(l, min_speed), max_speed);
+
+    // Packing 32 -> 16 bits needs AVX2 at 256 bits, so do it per half.
+    __m256i r32 = _mm256_cvtps_epi32(r);
+    __m256i l32 = _mm256_cvtps_epi32(l);
+    __m128i r16 = _mm_packs_epi32(_mm256_castsi256_si128(r32),
+                                  _mm256_extractf128_si256(r32, 1));
+    __m128i l16 = _mm_packs_epi32(_mm256_castsi256_si128(l32),
+                                  _mm256_extractf128_si256(l32, 1));
+    _mm_storeu_si128((__m128i*)(a.right + i), r16);
+    _mm_storeu_si128((__m128i*)(a.left + i), l16);
+  }
+}
+#endif  // FORMATION_HAVE_X86
+
+#ifdef FORMATION_HAVE_NEON
+// NEON's float -> int conversion truncates, so round half away from zero.
+inline int32x4_t RoundToInt(float32x4_t v) {
+  const float32x4_t half = vdupq_n_f32(0.5f);
+  uint32x4_t negative = vcltq_f32(v, vdupq_n_f32(0.0f));
+  float32x4_t bias = vbslq_f32(negative, vnegq_f32(half), half);
+  return vcvtq_s32_f32(vaddq_f32(v, bias));
+}
+
+void StepNeon(const KernelArgs& a) {
+  const float32x4_t cx = vdupq_n_f32(a.center_x);
+  const float32x4_t cy = vdupq_n_f32(a.center_y);
+  const float32x4_t half_base = vdupq_n_f32(a.half_base);
+  const float32x4_t arrive_sq = vdupq_n_f32(a.arrive_sq);
+  const float32x4_t max_speed = vdupq_n_f32(kMaxWheelSpeed);
+  const float32x4_t min_speed = vdupq_n_f32(-kMaxWheelSpeed);
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+
+  for (size_t i = 0; i < a.n; i += 4) {
+    float32x4_t ox = vld1q_f32(a.offset_x + i);
+    float32x4_t oy = vld1q_f32(a.offset_y + i);
+    float32x4_t tx = vmlaq_n_f32(vmlsq_n_f32(cx, oy, a.heading_sin), ox,
+                                 a.heading_cos);
+    float32x4_t ty = vmlaq_n_f32(vmlaq_n_f32(cy, ox, a.heading_sin), oy,
+                                 a.heading_cos);
+    float32x4_t ex = vsubq_f32(tx, vld1q_f32(a.x + i));
+    float32x4_t ey = vsubq_f32(ty, vld1q_f32(a.y + i));
+    float32x4_t c = vld1q_f32(a.cos + i);
+    float32x4_t s = vld1q_f32(a.sin + i);
+    float32x4_t fwd = vmlaq_f32(vmulq_f32(c, ex), s, ey);
+    float32x4_t lat = vmlsq_f32(vmulq_f32(c, ey), s, ex);
+
+    uint32x4_t arrived =
+        vcltq_f32(vmlaq_f32(vmulq_f32(fwd, fwd), lat, lat), arrive_sq);
+    float32x4_t v =
+        vbslq_f32(arrived, zero, vmulq_f32(vld1q_f32(a.kv + i), fwd));
+    float32x4_t w =
+        vbslq_f32(arrived, zero, vmulq_f32(vld1q_f32(a.kw + i), lat));
+
+    v = vminq_f32(vmaxq_f32(v, min_speed), max_speed);
+    float32x4_t r = vmlaq_f32(v, w, half_base);
+    float32x4_t l = vmlsq_f32(v, w, half_base);
+    r = vminq_f32(vmaxq_f32(r, min_speed), max_speed);
+    l = vminq_f32(vmaxq_f32(l, min_speed), max_speed);
+
+    vst1_s16(a.right + i, vqmovn_s32(RoundToInt(r)));
+    vst1_s16(a.left + i, vqmovn_s32(RoundToInt(l)));
+  }
+}
+#endif  // FORMATION_HAVE_NEON
+
+}  // namespace
+
+FormationController::FormationController() { SetKernel(kAuto); }
+
+void FormationController::Resize(size_t num_robots) {
+  size_ = num_robots;
+  size_t padded = (num_robots + kPadding - 1) / kPadding * kPadding;
+
+  x_.resize(padded, 0.0f);
+  y_.resize(padded, 0.0f);
+  cos_.resize(padded, 1.0f);
+  sin_.resize(padded, 0.0f);
+  active_.resize(padded, 0);
+  offset_x_.resize(padded, 0.0f);
+  offset_y_.resize(padded, 0.0f);
+  kv_.resize(padded, 0.0f);
+  kw_.resize(padded, 0.0f);
+  left_.resize(padded, 0);
+  right_.resize(padded, 0);
+  frames_.resize(num_robots * kFrameSize);
+}
+
+void FormationController::SetPose(size_t i, float x_mm, float y_mm,
+                                  float theta_rad) {
+  x_[i] = x_mm;
+  y_[i] = y_mm;
+  cos_[i] = std::cos(theta_rad);
+  sin_[i] = std::sin(theta_rad);
+}
+
+void FormationController::LoadPoses(const std::vector<RoombaState>& states) {
+  size_t n = std::min(states.size(), size_);
+  for (size_t i = 0; i < n; i++) {
+    SetPose(i, states[i].x_mm, states[i].y_mm, states[i].theta_rad);
+    active_[i] = states[i].connected && states[i].pose_known;
+  }
+  for (size_t i = n; i < size_; i++) {
+    active_[i] = 0;
+  }
+}
+
+void FormationController::SetOffset(size_t i, float x_mm, float y_mm) {
+  offset_x_[i] = x_mm;
+  offset_y_[i] = y_mm;
+}
+
+void FormationController::SetGains(size_t i, float kv, float kw) {
+  kv_[i] = kv;
+  kw_[i] = kw;
+}
+
+void FormationController::SetFormationPose(float x_mm, float y_mm,
+                                           float heading_rad) {
+  center_x_ = x_mm;
+  center_y_ = y_mm;
+  heading_cos_ = std::cos(heading_rad);
+  heading_sin_ = std::sin(heading_rad);
+}
+
+bool FormationController::IsKernelSupported(Kernel kernel) {
+  switch (kernel) {
+    case kAuto:
+    case kScalar:
+      return true;
+#ifdef FORMATION_HAVE_X86
+    case kSse:
+      return __builtin_cpu_supports("sse2");
+    case kAvx:
+      return __builtin_cpu_supports("avx");
+#endif
+#ifdef FORMATION_HAVE_NEON
+    case kNeon:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* FormationController::GetKernelName(Kernel kernel) {
+  switch (kernel) {
+    case kAuto:
+      return "auto";
+    case kScalar:
+      return "scalar";
+    case kSse:
+      return "sse";
+    case kAvx:
+      return "avx";
+    case kNeon:
+      return "neon";
+  }
+  return "unknown";
+}
+
+bool FormationController::SetKernel(Kernel kernel) {
+  if (kernel == kAuto) {
+    const Kernel preferred[] = {kAvx, kNeon, kSse, kScalar};
+    for (Kernel k : preferred) {
+      if (IsKernelSupported(k)) {
+        kernel_ = k;
+        return true;
+      }
+    }
+  }
+
+  if (!IsKernelSupported(kernel)) {
+    return false;
+  }
+
+  kernel_ = kernel;
+  return true;
+}
+
+void FormationController::Step() {
+  KernelArgs args;
+  args.x = x_.data();
+  args.y = y_.data();
+  args.cos = cos_.data();
+  args.sin = sin_.data();
+  args.offset_x = offset_x_.data();
+  args.offset_y = offset_y_.data();
+  args.kv = kv_.data();
+  args.kw = kw_.data();
+  args.center_x = center_x_;
+  args.center_y = center_y_;
+  args.heading_cos = heading_cos_;
+  args.heading_sin = heading_sin_;
+  args.half_base = oi::kWheelBaseMm * 0.5f;
+  args.arrive_sq = arrive_sq_;
+  args.left = left_.data();
+  args.right = right_.data();
+  args.n = x_.size();
+
+  switch (kernel_) {
+#ifdef FORMATION_HAVE_X86
+    case kSse:
+      StepSse(args);
+      break;
+    case kAvx:
+      StepAvx(args);
+      break;
+#endif
+#ifdef FORMATION_HAVE_NEON
+    case kNeon:
+      StepNeon(args);
+      break;
+#endif
+    default:
+      StepScalar(args);
+      break;
+  }
+
+  if (avoid_radius_ > 0.0f) {
+    AvoidCollisions();
+  } else {
+    num_avoiding_ = 0;
+    num_queried_ = 0;
+  }
+
+  uint8_t* frame = frames_.data();
+  for (size_t i = 0; i < size_; i++, frame += kFrameSize) {
+    if (!active_[i]) {
+      left_[i] = 0;
+      right_[i] = 0;
+    }
+    oi::EncodeDriveDirect(right_[i], left_[i], frame);
+  }
+}
+
+void FormationController::AvoidCollisions() {
+  active_x_.clear();
+  active_y_.clear();
+  active_index_.clear();
+  for (size_t i = 0; i < size_; i++) {
+    if (active_[i]) {
+      active_x_.push_back(x_[i]);
+      active_y_.push_back(y_[i]);
+      active_index_.push_back(uint32_t(i));
+    }
+  }
+
+  hash_.Build(active_x_.data(), active_y_.data(), active_x_.size(),
+              avoid_radius_);
+
+  num_avoiding_ = 0;
+  num_queried_ = 0;
+  for (uint32_t i : active_index_) {
+    // Twice the forward speed; only its sign matters.
+    int forward = int(left_[i]) + int(right_[i]);
+    if (forward == 0) {
+      continue;
+    }
+    num_queried_++;
+
+    neighbors_.clear();
+    hash_.QueryRadius(x_[i], y_[i], avoid_radius_, &neighbors_);
+
+    bool blocked = false;
+    for (uint32_t n : neighbors_) {
+      uint32_t j = active_index_[n];
+      if (j == i) {
+        continue;
+      }
+
+      // Distance to the neighbor along our heading. Only neighbors in the
+      // direction we're driving block us.
+      float ahead = cos_[i] * (x_[j] - x_[i]) + sin_[i] * (y_[j] - y_[i]);
+      if ((forward > 0 && ahead > 0.0f) || (forward < 0 && ahead < 0.0f)) {
+        blocked = true;
+        break;
+      }
+    }
+
+    if (blocked) {
+      int16_t turn = int16_t((int(right_[i]) - int(left_[i])) / 2);
+      right_[i] = turn;
+      left_[i] = int16_t(-turn);
+      num_avoiding_++;
+    }
+  }
+}
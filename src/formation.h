@@ -0,0 +1,112 @@
+#ifndef _FORMATION_H_
+#define _FORMATION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "roomba_state.h"
+#include "spatial_hash.h"
+
+// Formation controller. Keeps every robot's pose, formation offset and gains
+// in structure-of-arrays form, and each tick computes differential-drive
+// wheel velocities for the whole fleet with SIMD kernels, writing them
+// straight into Drive Direct frames ready for RoombaServer::SendEach().
+//
+// Robot i's target is the formation pose (center and heading) plus its offset
+// rotated into the formation frame. The control law works in the robot frame
+// so it needs no trigonometry per tick:
+//   forward = ( cos(theta) * ex + sin(theta) * ey)
+//   lateral = (-sin(theta) * ex + cos(theta) * ey)
+//   v = kv * forward,  w = kw * lateral
+// and robots within the arrival radius of their target stop.
+//
+// With collision avoidance on, Step() then overrides the command of every
+// robot that is driving towards another robot within the avoidance radius:
+// it drops the forward speed and keeps only the turn, so the robot stops and
+// can still rotate away. Neighbors are found with a SpatialHash rebuilt each
+// tick.
+class FormationController {
+ public:
+  enum Kernel { kAuto, kScalar, kSse, kAvx, kNeon };
+
+  FormationController();
+
+  // Sets the number of robots. Robot i corresponds to client slot i.
+  void Resize(size_t num_robots);
+  size_t GetSize() const { return size_; }
+
+  void SetPose(size_t i, float x_mm, float y_mm, float theta_rad);
+  // Inactive robots are commanded to stop and aren't obstacles for collision
+  // avoidance. Robots are inactive until set otherwise.
+  void SetActive(size_t i, bool active) { active_[i] = active; }
+  // Copies the poses out of a RoombaStateStore::SnapshotAll() result. Only
+  // connected roombas whose pose is in the arena frame are active; robots
+  // past the end of |states| are inactive.
+  void LoadPoses(const std::vector<RoombaState>& states);
+
+  void SetOffset(size_t i, float x_mm, float y_mm);
+  // |kv| in 1/s (mm/s per mm ahead), |kw| in rad/s per mm to the side.
+  void SetGains(size_t i, float kv, float kw);
+  void SetFormationPose(float x_mm, float y_mm, float heading_rad);
+  void SetArrivalRadius(float mm) { arrive_sq_ = mm * mm; }
+  // Center-to-center distance below which robots avoid each other. 0 (the
+  // default) disables collision avoidance.
+  void SetAvoidanceRadius(float mm) { avoid_radius_ = mm; }
+
+  // Selects the kernel Step() uses. kAuto picks the best one this CPU
+  // supports. Returns false (and changes nothing) if |kernel| isn't available
+  // in this build or on this CPU.
+  bool SetKernel(Kernel kernel);
+  Kernel GetKernel() const { return kernel_; }
+  static bool IsKernelSupported(Kernel kernel);
+  static const char* GetKernelName(Kernel kernel);
+
+  // Computes wheel velocities for every robot and encodes them into
+  // GetFrames(): one 5-byte Drive Direct frame per robot, back to back.
+  void Step();
+
+  const uint8_t* GetFrames() const { return frames_.data(); }
+  const int16_t* GetLeftVelocities() const { return left_.data(); }
+  const int16_t* GetRightVelocities() const { return right_.data(); }
+  // Number of robots whose command the last Step() overrode to avoid a
+  // collision.
+  size_t GetNumAvoiding() const { return num_avoiding_; }
+  // Number of robots the last Step() searched for neighbors: active robots
+  // that were driving rather than stopped or turning on the spot.
+  size_t GetNumQueried() const { return num_queried_; }
+
+  static const size_t kFrameSize = 5;
+
+ private:
+  void AvoidCollisions();
+
+  size_t size_ = 0;
+  Kernel kernel_ = kScalar;
+
+  // Pose, heading as a unit vector.
+  std::vector<float> x_, y_, cos_, sin_;
+  std::vector<uint8_t> active_;
+  // Formation offset and gains.
+  std::vector<float> offset_x_, offset_y_, kv_, kw_;
+
+  float center_x_ = 0.0f;
+  float center_y_ = 0.0f;
+  float heading_cos_ = 1.0f;
+  float heading_sin_ = 0.0f;
+  float arrive_sq_ = 50.0f * 50.0f;
+
+  std::vector<int16_t> left_, right_;
+  std::vector<uint8_t> frames_;
+
+  float avoid_radius_ = 0.0f;
+  size_t num_avoiding_ = 0;
+  size_t num_queried_ = 0;
+  SpatialHash hash_;
+  // Positions of the active robots, and their robot indices, for hash_.
+  std::vector<float> active_x_, active_y_;
+  std::vector<uint32_t> active_index_;
+  std::vector<uint32_t> neighbors_;
+};
+
+#endif  // _FORMATION_H_
@@ -0,0 +1,304 @@
+#include "hot_restart.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fd_passing.h"
+#include "logging.h"
+#include "roomba_identity.h"
+
+const char kHandoffFdFlag[] = "--handoff-fd";
+
+namespace {
+
+const uint32_t kHandoffMagic = 0x524d4248;  // "RMBH"
+const uint32_t kHandoffVersion = 4;
+
+// Clients are sent in batches so each message stays well below the kernel's
+// SCM_RIGHTS limit (253 descriptors).
+const size_t kClientsPerMessage = 64;
+
+struct HandoffHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_clients;
+  uint32_t reserved;
+};
+
+// Wire format of a client record. The socket travels as a descriptor.
+// Detached sessions have no descriptor; a message's descriptors belong to
+// its attached records, in order. Each message of records is followed by one
+// message per record with held commands, in the same order, holding
+// |num_held| commands as a uint32_t length followed by the bytes.
+struct HandoffRecord {
+  uint32_t slot;
+  int32_t pacer_tokens;
+  char id[kMaxRoombaIdLength + 1];
+  RoombaState state;
+  uint64_t detached_at_ns;  // 0 if attached
+  uint32_t num_held;
+  uint32_t held_bytes;  // size of the held commands message
+};
+
+bool SendHeld(int channel, const std::vector<std::vector<uint8_t>>& held) {
+  std::vector<uint8_t> message;
+  for (auto& command : held) {
+    uint32_t len = uint32_t(command.size());
+    const uint8_t* len_bytes = (const uint8_t*)&len;
+    message.insert(message.end(), len_bytes, len_bytes + sizeof(len));
+    message.insert(message.end(), command.begin(), command.end());
+  }
+  return SendWithFds(channel, message.data(), message.size(), nullptr, 0);
+}
+
+bool ReceiveHeld(int channel, const HandoffRecord& record,
+                 std::vector<std::vector<uint8_t>>* held) {
+  std::vector<uint8_t> message(record.held_bytes);
+  size_t num_fds = 0;
+  ssize_t ret = RecvWithFds(channel, message.data(), message.size(), nullptr,
+                            0, &num_fds);
+  if (ret != ssize_t(message.size())) {
+    return false;
+  }
+
+  size_t offset = 0;
+  for (uint32_t i = 0; i < record.num_held; i++) {
+    uint32_t len;
+    if (message.size() - offset < sizeof(len)) {
+      return false;
+    }
+    std::memcpy(&len, &message[offset], sizeof(len));
+    offset += sizeof(len);
+    if (message.size() - offset < len) {
+      return false;
+    }
+    held->emplace_back(message.begin() + offset,
+                       message.begin() + offset + len);
+    offset += len;
+  }
+  return offset == message.size();
+}
+
+}  // namespace
+
+int SpawnSuccessor(char* argv[]) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0) {
+    printf("socketpair failed, errno = %s\n", strerror(errno));
+    return -1;
+  }
+
+  // Build the new command line now; only async-signal-safe calls are allowed
+  // between fork() and exec() in a threaded process.
+  std::string fd_str = std::to_string(fds[1]);
+  std::vector<char*> args;
+  for (int i = 0; argv[i] != nullptr; i++) {
+    if (std::strcmp(argv[i], kHandoffFdFlag) == 0) {
+      // Drop the flag from our own restart, along with its value.
+      if (argv[i + 1] != nullptr) {
+        i++;
+      }
+      continue;
+    }
+    args.push_back(argv[i]);
+  }
+  args.push_back((char*)kHandoffFdFlag);
+  args.push_back((char*)fd_str.c_str());
+  args.push_back(nullptr);
+
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  if (max_fd < 0) {
+    max_fd = 1024;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    printf("fork failed, errno = %s\n", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    // Don't leak our sockets into the new process. If it inherited a stray
+    // copy of a client socket, that connection could never be closed.
+    for (int fd = 3; fd < max_fd; fd++) {
+      if (fd != fds[1]) {
+        close(fd);
+      }
+    }
+
+    execvp(args[0], args.data());
+    _exit(127);
+  }
+
+  close(fds[1]);
+  return fds[0];
+}
+
+bool SendHandoff(int channel, int listen_socket,
+                 const std::vector<HandoffClient>& clients) {
+  HandoffHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = kHandoffMagic;
+  header.version = kHandoffVersion;
+  header.num_clients = uint32_t(clients.size());
+  if (!SendWithFds(channel, &header, sizeof(header), &listen_socket, 1)) {
+    return false;
+  }
+
+  std::vector<HandoffRecord> records;
+  std::vector<int> fds;
+  for (size_t i = 0; i < clients.size(); i += kClientsPerMessage) {
+    size_t n = std::min(kClientsPerMessage, clients.size() - i);
+    records.resize(n);
+    fds.clear();
+    for (size_t j = 0; j < n; j++) {
+      const HandoffClient& client = clients[i + j];
+      std::memset(&records[j], 0, sizeof(HandoffRecord));
+      records[j].slot = client.slot;
+      records[j].pacer_tokens = client.pacer_tokens;
+      records[j].num_held = uint32_t(client.held.size());
+      for (auto& command : client.held) {
+        records[j].held_bytes += uint32_t(sizeof(uint32_t) + command.size());
+      }
+      std::strncpy(records[j].id, client.id.c_str(), kMaxRoombaIdLength);
+      records[j].state = client.state;
+      if (client.socket >= 0) {
+        fds.push_back(client.socket);
+      } else {
+        records[j].detached_at_ns =
+            std::max<uint64_t>(client.detached_at_ns, 1);
+      }
+    }
+
+    if (!SendWithFds(channel, records.data(), n * sizeof(HandoffRecord),
+                     fds.data(), fds.size())) {
+      return false;
+    }
+
+    for (size_t j = 0; j < n; j++) {
+      if (records[j].num_held != 0 && !SendHeld(channel, clients[i + j].held)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool ReceiveHandoff(int channel, int* listen_socket,
+                    std::vector<HandoffClient>* clients) {
+  HandoffHeader header;
+  size_t num_fds = 0;
+  ssize_t ret =
+      RecvWithFds(channel, &header, sizeof(header), listen_socket, 1, &num_fds);
+  if (ret != sizeof(header) || num_fds != 1) {
+    return false;
+  }
+
+  if (header.magic != kHandoffMagic || header.version != kHandoffVersion) {
+    printf("Handoff from an incompatible MasterServer (version %u)\n",
+           header.version);
+    close(*listen_socket);
+    return false;
+  }
+
+  clients->clear();
+  std::vector<HandoffRecord> records(kClientsPerMessage);
+  std::vector<int> fds(kClientsPerMessage);
+  while (clients->size() < header.num_clients) {
+    ret = RecvWithFds(channel, records.data(),
+                      records.size() * sizeof(HandoffRecord), fds.data(),
+                      fds.size(), &num_fds);
+    size_t n = ret > 0 ? size_t(ret) / sizeof(HandoffRecord) : 0;
+    size_t num_attached = 0;
+    for (size_t j = 0; j < n; j++) {
+      num_attached += records[j].detached_at_ns == 0;
+    }
+    if (ret <= 0 || num_attached != num_fds) {
+      for (size_t j = 0; j < num_fds; j++) {
+        close(fds[j]);
+      }
+      break;
+    }
+
+    size_t next_fd = 0;
+    for (size_t j = 0; j < n; j++) {
+      HandoffClient client;
+      client.detached_at_ns = records[j].detached_at_ns;
+      client.socket = client.detached_at_ns == 0 ? fds[next_fd++] : -1;
+      client.slot = records[j].slot;
+      client.id.assign(records[j].id,
+                       strnlen(records[j].id, sizeof(records[j].id)));
+      client.state = records[j].state;
+      client.pacer_tokens = records[j].pacer_tokens;
+      clients->push_back(client);
+    }
+
+    bool held_ok = true;
+    for (size_t j = 0; j < n && held_ok; j++) {
+      if (records[j].num_held != 0) {
+        HandoffClient& client = (*clients)[clients->size() - n + j];
+        held_ok = ReceiveHeld(channel, records[j], &client.held);
+      }
+    }
+    if (!held_ok) {
+      break;
+    }
+  }
+
+  if (clients->size() != header.num_clients) {
+    printf("Handoff ended early (%zu of %u clients)\n", clients->size(),
+           header.num_clients);
+    for (auto& client : *clients) {
+      if (client.socket >= 0) {
+        close(client.socket);
+      }
+    }
+    clients->clear();
+    close(*listen_socket);
+    return false;
+  }
+
+  return true;
+}
+
+bool AckHandoff(int channel) {
+  const char ack = 'k';
+  return SendWithFds(channel, &ack, 1, nullptr, 0);
+}
+
+bool WaitForSuccessor(int channel) {
+  timeval timeout;
+  timeout.tv_sec = kHandoffAckTimeoutMs / 1000;
+  timeout.tv_usec = (kHandoffAckTimeoutMs % 1000) * 1000;
+  setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char ack = 0;
+  ssize_t ret;
+  do {
+    ret = recv(channel, &ack, 1, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // Timed out. Once our end stops reading the successor's ack fails, so
+    // only an ack that's already queued can still count.
+    printf("No ack from the new process after %d ms.\n", kHandoffAckTimeoutMs);
+    shutdown(channel, SHUT_RD);
+    ret = recv(channel, &ack, 1, MSG_DONTWAIT);
+  }
+
+  close(channel);
+  return ret == 1 && ack == 'k';
+}
@@ -0,0 +1,66 @@
+#ifndef _HOT_RESTART_H_
+#define _HOT_RESTART_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "roomba_state.h"
+
+// Hot restart: hands the listen socket and every live roomba connection over
+// to a freshly exec'd MasterServer, so upgrading the binary doesn't drop the
+// fleet. The two processes talk over a SOCK_SEQPACKET Unix socket pair; file
+// descriptors travel as SCM_RIGHTS and per-client state rides alongside.
+//
+// The old process:                    The new process:
+//   channel = SpawnSuccessor(argv)      (started with --handoff-fd N)
+//   server.HandOff(channel)             server.InitializeFromHandoff(N)
+//     SendHandoff(channel)                ReceiveHandoff(N)
+//     WaitForSuccessor(channel)           AckHandoff(N)
+//   exit                                ...keeps serving
+//
+// The old process keeps its copies of every descriptor until the ack
+// arrives, so a successor that dies or gives up before acking costs nothing:
+// the old process just carries on serving. (One that hangs past the ack
+// timeout may already have sent some held commands, which then go out
+// twice.)
+
+// Minimal per-client state carried across a hot restart. Sessions waiting
+// for their roomba to reconnect travel without a socket.
+struct HandoffClient {
+  int socket;               // -1 for a detached session
+  uint64_t detached_at_ns;  // NowNs() at disconnect, 0 if connected
+  uint32_t slot;
+  std::string id;  // session id, empty for unidentified roombas
+  RoombaState state;
+  // Commands held for serial pacing, oldest first, and the pacer's level.
+  std::vector<std::vector<uint8_t>> held;
+  int32_t pacer_tokens;
+};
+
+// Command line flag used to pass the channel to the new process.
+extern const char kHandoffFdFlag[];
+
+// Forks and execs argv[0] with the same arguments plus --handoff-fd. Returns
+// our end of the channel, or -1 on failure.
+int SpawnSuccessor(char* argv[]);
+
+// Sends the listen socket and |clients|. Our copies of the descriptors stay
+// open; the caller closes them once WaitForSuccessor() succeeded.
+bool SendHandoff(int channel, int listen_socket,
+                 const std::vector<HandoffClient>& clients);
+
+// Receives what SendHandoff() sent. The descriptors are owned by the caller.
+bool ReceiveHandoff(int channel, int* listen_socket,
+                    std::vector<HandoffClient>* clients);
+
+// Tells the old process we're serving. Fails if the old process has given
+// up waiting, in which case it is serving the fleet again and we must let go.
+bool AckHandoff(int channel);
+// Waits up to kHandoffAckTimeoutMs for the ack, then closes |channel|. Once
+// this returns false the successor can no longer ack.
+bool WaitForSuccessor(int channel);
+
+const int kHandoffAckTimeoutMs = 10000;
+
+#endif  // _HOT_RESTART_H_
@@ -1,7 +1,13 @@
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <vector>
+
+#include <unistd.h>
 
 #include <avahi-client/client.h>
 #include <avahi-client/publish.h>
@@ -11,6 +17,10 @@
 #include <avahi-common/malloc.h>
 #include <avahi-common/thread-watch.h>
 
+#include "control_loop.h"
+#include "formation.h"
+#include "hot_restart.h"
+#include "realtime.h"
 #include "roomba_server.h"
 
 struct AvahiData {
@@ -116,52 +126,214 @@ static void client_callback(AvahiClient* c, AvahiClientState state,
   }
 }
 
-int main(int argc, char* argv[]) {
-  AvahiClient* client = nullptr;
-  AvahiThreadedPoll* thread_poll = nullptr;
+// Publishes the roomba service. Returns the Avahi client, or nullptr if Avahi
+// isn't available (the server works without it).
+static AvahiClient* StartAvahi(AvahiData* data) {
+  std::memset(data, 0, sizeof(*data));
+  data->thread_poll = avahi_threaded_poll_new();
+  if (!data->thread_poll) {
+    printf("Failed to allocate threaded poller.\n");
+    return nullptr;
+  }
+
   int error;
+  AvahiClient* client =
+      avahi_client_new(avahi_threaded_poll_get(data->thread_poll),
+                       AvahiClientFlags(0), client_callback, data, &error);
+  if (!client) {
+    printf("Failed to create client. %s\n", avahi_strerror(error));
+    avahi_threaded_poll_free(data->thread_poll);
+    data->thread_poll = nullptr;
+    return nullptr;
+  }
 
-  RoombaServer roomba_server;
-  if (!roomba_server.Initialize(1444)) {
-    printf("Failed to start the roomba server.\n");
-    return 1;
+  avahi_threaded_poll_start(data->thread_poll);
+  return client;
+}
+
+static void StopAvahi(AvahiData* data, AvahiClient* client) {
+  if (client) {
+    avahi_threaded_poll_stop(data->thread_poll);
+    avahi_client_free(client);
+    avahi_threaded_poll_free(data->thread_poll);
+    data->thread_poll = nullptr;
+    data->group = nullptr;
   }
+}
 
-  // Allocate the simple polling loop
-  thread_poll = avahi_threaded_poll_new();
-  if (!thread_poll) {
-    printf("Failed to allocate threaded poller.\n");
+// Lays |num_robots| out in rings of 16 around the formation center, 400 mm
+// apart, with slot 0 on the inner ring facing the formation heading.
+static void SetUpRingFormation(FormationController* formation,
+                               size_t num_robots) {
+  const size_t kPerRing = 16;
+  const float kPi = 3.14159265f;
+
+  formation->Resize(num_robots);
+  for (size_t i = 0; i < formation->GetSize(); i++) {
+    float angle = 2.0f * kPi * float(i % kPerRing) / kPerRing;
+    float radius = 800.0f + 400.0f * float(i / kPerRing);
+    formation->SetOffset(i, radius * std::cos(angle), radius * std::sin(angle));
+    formation->SetGains(i, 1.0f, 0.005f);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  RealtimeConfig rt_config;
+  // The formation loop gets its own CPU and priority so it doesn't compete
+  // with the network worker it feeds.
+  RealtimeConfig control_rt_config;
+  RoombaIdentityMap identity_map;
+  int handoff_fd = -1;
+  int trace_sample = 0;
+  uint32_t formation_period_us = 0;
+  size_t max_roombas = RoombaStateStore::kDefaultCapacity;
+  float avoid_radius_mm = 0.0f;
+  const char* ingress_path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], kHandoffFdFlag) == 0 && i + 1 < argc) {
+      handoff_fd = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+      trace_sample = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--formation-hz") == 0 && i + 1 < argc) {
+      int hz = std::atoi(argv[++i]);
+      formation_period_us = hz > 0 ? 1000000 / hz : 0;
+    } else if (std::strcmp(argv[i], "--max-roombas") == 0 && i + 1 < argc) {
+      max_roombas = size_t(std::max(std::atoi(argv[++i]), 1));
+    } else if (std::strcmp(argv[i], "--avoid-mm") == 0 && i + 1 < argc) {
+      avoid_radius_mm = float(std::atof(argv[++i]));
+    } else if (std::strcmp(argv[i], "--ingress") == 0 && i + 1 < argc) {
+      ingress_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--control-cpu") == 0 && i + 1 < argc) {
+      control_rt_config.cpu = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--control-priority") == 0 &&
+               i + 1 < argc) {
+      control_rt_config.priority = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--roomba-map") == 0 && i + 1 < argc) {
+      if (!identity_map.Load(argv[++i])) {
+        return 1;
+      }
+    } else if (!ParseRealtimeFlag(argc, argv, &i, &rt_config)) {
+      printf("Unknown argument %s\n", argv[i]);
+      printf("Usage: %s [--roomba-map FILE] [--max-roombas N] "
+             "[--ingress SOCKET] "
+             "[--trace-sample N] [--formation-hz N] [--avoid-mm N] "
+             "[--control-cpu N] [--control-priority N] "
+             "[--rt-cpu N] [--rt-priority N] [--mlock]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  // Odometry starts at zero wherever each roomba connects, so the formation
+  // only makes sense for roombas the map places in a shared frame.
+  if (formation_period_us != 0 && !identity_map.HasStartPoses()) {
+    printf("--formation-hz needs start poses in the --roomba-map file.\n");
     return 1;
   }
 
-  AvahiData data;
-  std::memset(&data, 0, sizeof(data));
-  data.thread_poll = thread_poll;
+  RoombaServer roomba_server(max_roombas);
+  roomba_server.SetRealtimeConfig(rt_config);
+  roomba_server.SetIdentityMap(identity_map);
+  roomba_server.SetTraceSampling(trace_sample);
+  if (ingress_path != nullptr) {
+    roomba_server.SetIngressPath(ingress_path);
+  }
+  if (handoff_fd != -1) {
+    // We're the new binary of a hot restart. Take over from the old process.
+    if (!roomba_server.InitializeFromHandoff(handoff_fd)) {
+      printf("Failed to resume from the previous roomba server.\n");
+      return 1;
+    }
 
-  client =
-      avahi_client_new(avahi_threaded_poll_get(thread_poll),
-                       AvahiClientFlags(0), client_callback, &data, &error);
-  if (!client) {
-    printf("Failed to create client. %s\n", avahi_strerror(error));
-    avahi_threaded_poll_free(thread_poll);
-    thread_poll = nullptr;
+    if (!AckHandoff(handoff_fd)) {
+      printf("The previous server took the roombas back, exiting.\n");
+      roomba_server.Abandon();
+      return 1;
+    }
+    close(handoff_fd);
+  } else if (!roomba_server.Initialize(1444)) {
+    printf("Failed to start the roomba server.\n");
+    return 1;
   }
 
-  if (thread_poll != nullptr) {
-    avahi_threaded_poll_start(thread_poll);
+  // Drive the fleet into formation from odometry, one batch of Drive Direct
+  // commands per tick. Roombas without a start pose are told to stay put.
+  FormationController formation;
+  ControlLoop formation_loop;
+  std::vector<RoombaState> states;
+  auto start_formation = [&]() {
+    formation_loop.Start(
+        formation_period_us,
+        [&](uint64_t, uint64_t) {
+          roomba_server.GetStateStore().SnapshotAll(&states);
+          if (states.size() > formation.GetSize()) {
+            // Slots are only ever added, so this settles quickly.
+            SetUpRingFormation(&formation, states.size());
+          }
+          formation.LoadPoses(states);
+          formation.Step();
+          roomba_server.SendEach(formation.GetFrames(),
+                                 FormationController::kFrameSize,
+                                 formation.GetSize());
+          roomba_server.FlushTick();
+        },
+        control_rt_config);
+  };
+  if (formation_period_us != 0) {
+    formation.SetAvoidanceRadius(avoid_radius_mm);
+    roomba_server.SetTickBatching(true);
+    start_formation();
+    printf("Running the formation controller (%s kernel).\n",
+           FormationController::GetKernelName(formation.GetKernel()));
   }
 
+  AvahiData data;
+  AvahiClient* client = StartAvahi(&data);
+
   // TODO: Run input on this thread
   // ...
   printf("Listening for new connections.\n");
-  printf("Press the any key to exit.\n");
-  getchar();
+  printf("Press enter to exit, r and enter to hot restart");
+  if (trace_sample > 0) {
+    printf(", t and enter to dump the command trace");
+  }
+  printf(".\n");
 
-  if (client) {
-    avahi_threaded_poll_stop(thread_poll);
-    avahi_client_free(client);
+  char line[64];
+  while (fgets(line, sizeof(line), stdin)) {
+    if (line[0] == 't' && trace_sample > 0) {
+      const char* path = "roomba_trace.json";
+      if (roomba_server.DumpTrace(path)) {
+        printf("Wrote the command trace to %s\n", path);
+      }
+      continue;
+    }
+
+    if (line[0] != 'r') {
+      break;
+    }
+
+    // Exec the (possibly upgraded) binary and hand the fleet over to it. The
+    // new process publishes the service itself.
+    formation_loop.Stop();
+    StopAvahi(&data, client);
+    int channel = SpawnSuccessor(argv);
+    if (channel != -1 && roomba_server.HandOff(channel)) {
+      printf("Handed all connections over to the new process.\n");
+      return 0;
+    }
+
+    // The server is still running, so carry on serving.
+    printf("Hot restart failed, still serving.\n");
+    client = StartAvahi(&data);
+    if (formation_period_us != 0) {
+      start_formation();
+    }
   }
 
+  formation_loop.Stop();
+  StopAvahi(&data, client);
+
   roomba_server.Shutdown();
   return 0;
 }
\ No newline at end of file
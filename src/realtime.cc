@@ -0,0 +1,83 @@
+#include "realtime.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+bool LockProcessMemory() {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    printf("mlockall failed, errno = %s\n", strerror(errno));
+    return false;
+  }
+
+  // Touch a chunk of stack so it is resident before we need it. The stores
+  // go through the volatile array so the compiler can't drop them; one per
+  // page is enough.
+  const size_t kPageSize = 4096;
+  volatile char stack_prefault[64 * 1024];
+  for (size_t i = 0; i < sizeof(stack_prefault); i += kPageSize) {
+    stack_prefault[i] = 0;
+  }
+  return true;
+}
+
+bool ApplyRealtimeConfig(const RealtimeConfig& config) {
+  bool ok = true;
+
+  if (config.lock_memory) {
+    ok &= LockProcessMemory();
+  }
+
+  if (config.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(config.cpu, &set);
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status != 0) {
+      printf("Failed to pin thread to CPU %d, errno = %s\n", config.cpu,
+             strerror(status));
+      ok = false;
+    }
+  }
+
+  if (config.priority > 0) {
+    sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = config.priority;
+    int status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (status != 0) {
+      printf("Failed to set SCHED_FIFO priority %d, errno = %s\n",
+             config.priority, strerror(status));
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+bool ParseRealtimeFlag(int argc, char* argv[], int* i, RealtimeConfig* config) {
+  const char* arg = argv[*i];
+  if (std::strcmp(arg, "--mlock") == 0) {
+    config->lock_memory = true;
+    return true;
+  }
+
+  if (*i + 1 >= argc) {
+    return false;
+  }
+
+  if (std::strcmp(arg, "--rt-cpu") == 0) {
+    config->cpu = std::atoi(argv[++*i]);
+    return true;
+  } else if (std::strcmp(arg, "--rt-priority") == 0) {
+    config->priority = std::atoi(argv[++*i]);
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,28 @@
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+
+// Real-time scheduling options for a latency-sensitive thread (the network
+// worker or the control loop). Everything is opt-in: a default-constructed
+// config leaves the thread exactly as the OS created it.
+struct RealtimeConfig {
+  int cpu = -1;              // CPU to pin the thread to, -1 = any
+  int priority = 0;          // SCHED_FIFO priority (1-99), 0 = SCHED_OTHER
+  bool lock_memory = false;  // mlockall() the whole process
+
+  bool IsEnabled() const { return cpu >= 0 || priority > 0 || lock_memory; }
+};
+
+// Applies |config| to the calling thread. Failures (usually a missing
+// CAP_SYS_NICE or a low RLIMIT_MEMLOCK) are logged and are not fatal; the
+// thread keeps whatever settings did apply. Returns true if all of them did.
+bool ApplyRealtimeConfig(const RealtimeConfig& config);
+
+// Locks all current and future pages of the process into RAM and pre-faults
+// some stack so the first deep call doesn't page fault mid-tick.
+bool LockProcessMemory();
+
+// Parses the shared --rt-cpu / --rt-priority / --mlock flags at argv[*i],
+// advancing *i past any value. Returns false if argv[*i] isn't one of them.
+bool ParseRealtimeFlag(int argc, char* argv[], int* i, RealtimeConfig* config);
+
+#endif  // _REALTIME_H_
@@ -1,18 +1,551 @@
 #include "roomba_client.h"
 
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
 #include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-RoombaClient::RoombaClient(int socket) : socket_(socket) {}
+#include "clock.h"
+#include "roomba_identity.h"
+
+RoombaClient::RoombaClient(int socket, size_t slot, uint32_t connection_id)
+    : socket_(socket), slot_(slot), connection_id_(connection_id) {
+    std::memset(&state_, 0, sizeof(state_));
+    state_.connected = 1;
+}
+
+void RoombaClient::RestoreState(const RoombaState& state) {
+    state_ = state;
+    state_.connected = 1;
+    have_encoders_ = state.timestamp_ns != 0;
+}
+
+void RoombaClient::SetStartPose(const RoombaPose& pose) {
+    state_.x_mm = pose.x_mm;
+    state_.y_mm = pose.y_mm;
+    state_.theta_rad = pose.theta_rad;
+    state_.pose_known = 1;
+}
 
 void RoombaClient::Close() {
-    close(socket_);
+    if (socket_ >= 0) {
+        close(socket_);
+        socket_ = -1;
+    }
+}
+
+void RoombaClient::Detach() {
+    Close();
+    corked_ = false;
+
+    // Whatever is still staged will be the start of the next socket's stream.
+    for (auto& traced : traced_staged_) {
+        traced.end_offset -= socket_bytes_;
+    }
+    socket_bytes_ = 0;
+    traced_in_flight_.clear();
+    state_.connected = 0;
+    detached_at_ns_ = NowNs();
+
+    // Held commands wait for Attach() rather than for pacing tokens.
+    next_release_ns_ = 0;
+}
+
+void RoombaClient::RestoreDetached(uint64_t detached_at_ns) {
+    Detach();
+    detached_at_ns_ = detached_at_ns;
+}
+
+void RoombaClient::Attach(int socket, uint32_t connection_id) {
+    socket_ = socket;
+    connection_id_ = connection_id;
+    state_.connected = 1;
+    detached_at_ns_ = 0;
+    awaiting_hello_ = false;
+
+    // The old stream may have died mid-frame.
+    parser_ = oi::StreamParser();
+
+    // Re-apply the socket options for the current mode, and send anything
+    // left staged from the old connection unless the next tick will.
+    bool batching = batching_;
+    batching_ = false;
+    SetBatching(batching);
+    if (!batching_) {
+        WritePending();
+    }
+
+    // Commands held while we were away go out at the serial rate like any
+    // others.
+    if (!held_.empty() && ReleaseHeld(NowNs()) != 0) {
+        release_requested_ = true;
+    }
+}
+
+int RoombaClient::ReleaseSocket() {
+    int socket = socket_;
+    socket_ = -1;
+    return socket;
+}
+
+void RoombaClient::ExpectHello(uint64_t deadline_ns) {
+    awaiting_hello_ = true;
+    hello_deadline_ns_ = deadline_ns;
+    hello_line_.clear();
+    hello_id_.clear();
+}
+
+size_t RoombaClient::ParseHello(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (hello_line_.empty() && data[i] != 'H') {
+            // Not a hello, so this is already the sensor stream.
+            awaiting_hello_ = false;
+            return i;
+        }
+
+        if (data[i] == '\n') {
+            awaiting_hello_ = false;
+            if (hello_line_.compare(0, 6, "HELLO ") == 0) {
+                std::string id = hello_line_.substr(6);
+                if (!id.empty() && id.back() == '\r') {
+                    id.pop_back();
+                }
+                if (IsValidRoombaId(id)) {
+                    hello_id_ = id;
+                }
+            }
+            return i + 1;
+        }
+
+        hello_line_.push_back(char(data[i]));
+        if (hello_line_.size() > kMaxRoombaIdLength + 8) {
+            // Too long to be a hello; give up on it.
+            awaiting_hello_ = false;
+            return i + 1;
+        }
+    }
+
+    return len;
+}
+
+SendStats& SendStats::operator+=(const SendStats& other) {
+    commands += other.commands;
+    write_calls += other.write_calls;
+    bytes += other.bytes;
+    segments += other.segments;
+    paced_holds += other.paced_holds;
+    paced_coalesced += other.paced_coalesced;
+    paced_drops += other.paced_drops;
+    paced_held_now += other.paced_held_now;
+    return *this;
 }
 
-bool RoombaClient::Send(const void* data, size_t len) {
-    int ret = write(socket_, data, len);
-    return ret >= 0;
-}
\ No newline at end of file
+bool RoombaClient::Send(const void* data, size_t len, uint64_t cmd_id) {
+    stats_.commands++;
+    if (tracer_ == nullptr) {
+        cmd_id = 0;
+    }
+
+    if (socket_ < 0) {
+        // Detached: hold everything until the roomba is back.
+        return Hold(data, len, cmd_id, NowNs());
+    }
+
+    if (pacer_.IsEnabled()) {
+        // Keep commands in order: once anything is held, everything is.
+        uint64_t now = NowNs();
+        if (!held_.empty() || !pacer_.TryConsume(len, now)) {
+            return Hold(data, len, cmd_id, now);
+        }
+    }
+
+    return SendAdmitted(data, len, cmd_id);
+}
+
+bool RoombaClient::Hold(const void* data, size_t len, uint64_t cmd_id,
+                        uint64_t now_ns) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    oi::CoalesceClass coalesce_class = oi::GetCoalesceClass(bytes, len);
+    if (coalesce_class != oi::kCoalesceNone) {
+        for (auto it = held_.begin(); it != held_.end(); ++it) {
+            if (it->coalesce_class != coalesce_class) {
+                continue;
+            }
+
+            // The newer command supersedes the held one.
+            if (it->cmd_id && tracer_) {
+                tracer_->Span("coalesced", it->held_ns, now_ns, it->cmd_id,
+                              int(slot_), true);
+            }
+            stats_.paced_coalesced++;
+
+            if (it + 1 == held_.end()) {
+                it->bytes.assign(bytes, bytes + len);
+                it->cmd_id = cmd_id;
+                it->held_ns = now_ns;
+                return true;
+            }
+
+            // Taking the old one's place would jump ahead of the commands
+            // held after it (a mode change, say), so drop it and queue the
+            // new one last.
+            bool was_front = it == held_.begin();
+            held_.erase(it);
+            if (was_front && socket_ >= 0) {
+                next_release_ns_ =
+                    pacer_.GetReadyTime(held_.front().bytes.size(), now_ns);
+            }
+            break;
+        }
+    }
+
+    if (held_.size() >= kMaxHeldCommands) {
+        stats_.paced_drops++;
+        return false;
+    }
+
+    HeldCommand held;
+    held.coalesce_class = coalesce_class;
+    held.bytes.assign(bytes, bytes + len);
+    held.cmd_id = cmd_id;
+    held.held_ns = now_ns;
+    held_.push_back(held);
+    stats_.paced_holds++;
+
+    if (held_.size() == 1 && socket_ >= 0) {
+        next_release_ns_ = pacer_.GetReadyTime(len, now_ns);
+        release_requested_ = true;
+    }
+    return true;
+}
+
+void RoombaClient::SetPacing(uint32_t bytes_per_s, uint32_t burst_bytes) {
+    pacer_.Configure(bytes_per_s, burst_bytes, NowNs());
+    if (!pacer_.IsEnabled() && socket_ >= 0) {
+        while (!held_.empty()) {
+            SendAdmitted(held_.front().bytes.data(), held_.front().bytes.size(),
+                         held_.front().cmd_id);
+            held_.pop_front();
+        }
+        next_release_ns_ = 0;
+    }
+}
+
+void RoombaClient::ExportHeld(std::vector<std::vector<uint8_t>>* commands,
+                              int32_t* pacer_tokens) {
+    commands->clear();
+    for (auto& held : held_) {
+        commands->push_back(held.bytes);
+    }
+    *pacer_tokens = int32_t(std::floor(pacer_.GetTokens(NowNs())));
+}
+
+void RoombaClient::RestoreHeld(const std::vector<std::vector<uint8_t>>& commands,
+                               int32_t pacer_tokens) {
+    uint64_t now = NowNs();
+    pacer_.SetTokens(double(pacer_tokens), now);
+    for (auto& bytes : commands) {
+        HeldCommand held;
+        held.coalesce_class = oi::GetCoalesceClass(bytes.data(), bytes.size());
+        held.bytes = bytes;
+        held.cmd_id = 0;
+        held.held_ns = now;
+        held_.push_back(held);
+    }
+
+    if (!held_.empty() && socket_ >= 0) {
+        next_release_ns_ = pacer_.GetReadyTime(held_.front().bytes.size(), now);
+        release_requested_ = true;
+    }
+}
+
+uint64_t RoombaClient::ReleaseHeld(uint64_t now_ns) {
+    if (socket_ < 0) {
+        return 0;
+    }
+
+    bool released = false;
+    while (!held_.empty() &&
+           pacer_.TryConsume(held_.front().bytes.size(), now_ns)) {
+        HeldCommand& held = held_.front();
+        if (held.cmd_id && tracer_) {
+            tracer_->Span("paced", held.held_ns, now_ns, held.cmd_id,
+                          int(slot_), true);
+        }
+        SendAdmitted(held.bytes.data(), held.bytes.size(), held.cmd_id);
+        held_.pop_front();
+        released = true;
+    }
+
+    // These were already spaced out by the pacer, so don't also hold them
+    // for the end of the tick.
+    if (released && batching_) {
+        WritePending();
+    }
+
+    next_release_ns_ =
+        held_.empty() ? 0
+                      : pacer_.GetReadyTime(held_.front().bytes.size(), now_ns);
+    return next_release_ns_;
+}
+
+bool RoombaClient::TakeReleaseRequest() {
+    bool requested = release_requested_;
+    release_requested_ = false;
+    return requested;
+}
+
+bool RoombaClient::SendAdmitted(const void* data, size_t len,
+                                uint64_t cmd_id) {
+    if (socket_ < 0) {
+        // Only held commands should reach here while detached, and those
+        // wait for Attach().
+        stats_.paced_drops++;
+        return false;
+    }
+
+    if (!batching_) {
+        uint64_t start_ns = cmd_id ? NowNs() : 0;
+        stats_.write_calls++;
+        int ret = write(socket_, data, len);
+        if (ret > 0) {
+            stats_.bytes += ret;
+            socket_bytes_ += ret;
+        }
+
+        if (cmd_id && ret > 0) {
+            uint64_t end_ns = NowNs();
+            tracer_->Span("write", start_ns, end_ns, cmd_id, int(slot_));
+            AddInFlight(cmd_id, socket_bytes_, end_ns);
+            PollAcks();
+        }
+        return ret >= 0;
+    }
+
+    if (staged_.size() + len > kMaxStagedBytes) {
+        // Too much for one tick. Cork the socket so what we spill now and the
+        // rest of the tick still leave in full-sized segments.
+        SetCork(true);
+        if (!WritePending()) {
+            return false;
+        }
+    }
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    staged_.insert(staged_.end(), bytes, bytes + len);
+    if (cmd_id) {
+        TracedCommand traced = {cmd_id, socket_bytes_ + staged_.size(),
+                                NowNs()};
+        traced_staged_.push_back(traced);
+    }
+    return true;
+}
+
+void RoombaClient::SetBatching(bool enabled) {
+    if (batching_ && !enabled) {
+        Flush();
+    }
+
+    if (enabled && socket_ >= 0) {
+        int opt = 1;
+        setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    batching_ = enabled;
+}
+
+bool RoombaClient::Flush() {
+    // Held commands whose time has come ride along with this tick.
+    if (!held_.empty()) {
+        ReleaseHeld(NowNs());
+    }
+
+    bool ok = WritePending();
+
+    // Uncorking pushes out anything the kernel is still holding.
+    if (corked_) {
+        SetCork(false);
+    }
+    return ok;
+}
+
+bool RoombaClient::WritePending() {
+    if (staged_.empty() || socket_ < 0) {
+        return true;
+    }
+
+    uint64_t start_ns = traced_staged_.empty() ? 0 : NowNs();
+    stats_.write_calls++;
+    ssize_t ret = write(socket_, staged_.data(), staged_.size());
+    if (ret < 0) {
+        // A full socket buffer isn't fatal, we'll retry on the next flush.
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    stats_.bytes += ret;
+    socket_bytes_ += ret;
+    staged_.erase(staged_.begin(), staged_.begin() + ret);
+
+    if (!traced_staged_.empty()) {
+        uint64_t end_ns = NowNs();
+        size_t num_written = 0;
+        for (auto& traced : traced_staged_) {
+            if (traced.end_offset > socket_bytes_) {
+                break;
+            }
+
+            tracer_->Span("queued", traced.start_ns, start_ns, traced.cmd_id,
+                          int(slot_), true);
+            tracer_->Span("write", start_ns, end_ns, traced.cmd_id, int(slot_));
+            AddInFlight(traced.cmd_id, traced.end_offset, end_ns);
+            num_written++;
+        }
+        traced_staged_.erase(traced_staged_.begin(),
+                             traced_staged_.begin() + num_written);
+        PollAcks();
+    }
+    return true;
+}
+
+void RoombaClient::AddInFlight(uint64_t cmd_id, uint64_t end_offset,
+                               uint64_t sent_ns) {
+    if (traced_in_flight_.size() >= kMaxTracesInFlight) {
+        traced_in_flight_.erase(traced_in_flight_.begin());
+    }
+
+    TracedCommand traced = {cmd_id, end_offset, sent_ns};
+    traced_in_flight_.push_back(traced);
+}
+
+void RoombaClient::PollAcks() {
+    if (traced_in_flight_.empty() || socket_ < 0) {
+        return;
+    }
+
+    // SIOCOUTQ is the number of bytes the peer hasn't acknowledged yet.
+    int unacked = 0;
+    if (ioctl(socket_, SIOCOUTQ, &unacked) != 0) {
+        return;
+    }
+
+    uint64_t acked = socket_bytes_ - uint64_t(unacked);
+    uint64_t now = NowNs();
+    size_t num_acked = 0;
+    for (auto& traced : traced_in_flight_) {
+        if (traced.end_offset > acked) {
+            break;
+        }
+
+        tracer_->Span("in flight", traced.start_ns, now, traced.cmd_id,
+                      int(slot_), true);
+        num_acked++;
+    }
+    traced_in_flight_.erase(traced_in_flight_.begin(),
+                            traced_in_flight_.begin() + num_acked);
+}
+
+void RoombaClient::SetCork(bool cork) {
+    int opt = cork ? 1 : 0;
+    setsockopt(socket_, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    corked_ = cork;
+}
+
+SendStats RoombaClient::GetSendStats() const {
+    SendStats stats = stats_;
+    stats.paced_held_now = held_.size();
+
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    std::memset(&info, 0, sizeof(info));
+    if (socket_ >= 0 &&
+        getsockopt(socket_, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        stats.segments = info.tcpi_segs_out;
+    }
+    return stats;
+}
+
+int RoombaClient::Receive() {
+    uint8_t buf[512];
+    int num_frames = 0;
+
+    // Edge-triggered, so keep reading until the socket is drained.
+    while (true) {
+        ssize_t ret = read(socket_, buf, sizeof(buf));
+        if (ret > 0) {
+            size_t offset = awaiting_hello_ ? ParseHello(buf, size_t(ret)) : 0;
+            num_frames += int(parser_.Feed(buf + offset, size_t(ret) - offset,
+                                           &OnSensorPacket, &OnSensorFrame,
+                                           this));
+        } else if (ret == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return num_frames;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+void RoombaClient::OnSensorPacket(const oi::SensorPacket& packet,
+                                  void* userdata) {
+    RoombaClient* client = (RoombaClient*)userdata;
+    RoombaState& state = client->state_;
+
+    switch (packet.id) {
+        case oi::kPacketBumpsWheelDrops:
+            state.bumps_wheel_drops = uint8_t(packet.value);
+            break;
+        case oi::kPacketVoltage:
+            state.voltage_mv = uint16_t(packet.value);
+            break;
+        case oi::kPacketCurrent:
+            state.current_ma = int16_t(packet.value);
+            break;
+        case oi::kPacketBatteryCharge:
+            state.battery_charge_mah = uint16_t(packet.value);
+            break;
+        case oi::kPacketBatteryCapacity:
+            state.battery_capacity_mah = uint16_t(packet.value);
+            break;
+        case oi::kPacketEncoderLeft:
+            client->pending_left_ = uint16_t(packet.value);
+            break;
+        case oi::kPacketEncoderRight:
+            client->pending_right_ = uint16_t(packet.value);
+            break;
+    }
+}
+
+void RoombaClient::OnSensorFrame(void* userdata) {
+    RoombaClient* client = (RoombaClient*)userdata;
+    client->UpdateOdometry(client->pending_left_, client->pending_right_);
+    client->state_.timestamp_ns = NowNs();
+}
+
+void RoombaClient::UpdateOdometry(uint16_t left, uint16_t right) {
+    if (have_encoders_) {
+        // Encoder counts wrap at 16 bits; the signed difference handles that.
+        const float mm_per_count =
+            float(M_PI) * oi::kWheelDiameterMm / oi::kCountsPerRev;
+        float dl = float(int16_t(left - state_.encoder_left)) * mm_per_count;
+        float dr = float(int16_t(right - state_.encoder_right)) * mm_per_count;
+        float dtheta = (dr - dl) / oi::kWheelBaseMm;
+        float mid = state_.theta_rad + dtheta * 0.5f;
+
+        state_.x_mm += (dl + dr) * 0.5f * std::cos(mid);
+        state_.y_mm += (dl + dr) * 0.5f * std::sin(mid);
+        state_.theta_rad = std::remainder(state_.theta_rad + dtheta,
+                                          2.0f * float(M_PI));
+    }
+
+    state_.encoder_left = left;
+    state_.encoder_right = right;
+    have_encoders_ = true;
+}
@@ -3,23 +3,209 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
 
 #include <netinet/in.h>
 #include <semaphore.h>
 
+#include "roomba_identity.h"
+#include "roomba_oi.h"
+#include "roomba_state.h"
+#include "token_bucket.h"
+#include "trace.h"
+
+// Outgoing traffic counters, used to compare the immediate and tick-batched
+// send modes and to see what serial pacing is doing.
+struct SendStats {
+  uint64_t commands = 0;     // Send() calls
+  uint64_t write_calls = 0;  // write() syscalls
+  uint64_t bytes = 0;        // bytes handed to the kernel
+  uint64_t segments = 0;     // TCP segments sent (TCP_INFO, live sockets only)
+
+  uint64_t paced_holds = 0;      // commands held back by the serial pacer
+  uint64_t paced_coalesced = 0;  // held commands replaced by a newer one
+  uint64_t paced_drops = 0;      // commands refused because the hold was full
+  uint64_t paced_held_now = 0;   // commands currently held
+
+  SendStats& operator+=(const SendStats& other);
+};
+
 // (simple) Roomba client. Represents a stream to a single roomba robot.
 // This can send raw bytecode commands into the roomba robot. This is /very/
 // insecure and is only used for development purposes.
 class RoombaClient {
  public:
-  RoombaClient(int socket);
+  // |connection_id| tells this socket apart from earlier ones that served the
+  // same slot; see Attach().
+  RoombaClient(int socket, size_t slot, uint32_t connection_id);
 
   void Close();
-  bool Send(const void* data, size_t len);
+
+  // Sends (or in batching mode stages) a command. While detached, commands
+  // are held as if by serial pacing (coalesced, and refused beyond
+  // kMaxHeldCommands) and are paced out once the roomba is back.
+  // A non-zero |cmd_id| traces the command through the tracer (see trace.h).
+  bool Send(const void* data, size_t len, uint64_t cmd_id = 0);
+
+  // Serial pacing. Commands are admitted at |bytes_per_s| (the roomba's
+  // serial rate behind its Wi-Fi bridge) with bursts of up to |burst_bytes|;
+  // the rest are held here, oldest first, with a newer drive or LED command
+  // replacing a held one of the same kind. 0 disables pacing and sends
+  // everything still held.
+  void SetPacing(uint32_t bytes_per_s, uint32_t burst_bytes);
+
+  // Hot restart. ExportHeld() copies out the held commands, oldest first,
+  // and the pacer's token level; RestoreHeld() takes them back in a new
+  // process, after SetPacing(), so nothing is sent faster across a restart
+  // than it would have been without one.
+  void ExportHeld(std::vector<std::vector<uint8_t>>* commands,
+                  int32_t* pacer_tokens);
+  void RestoreHeld(const std::vector<std::vector<uint8_t>>& commands,
+                   int32_t pacer_tokens);
+
+  // Sends held commands whose tokens have accrued by |now_ns|. Returns when
+  // the next held command can go, or 0 if nothing is held.
+  uint64_t ReleaseHeld(uint64_t now_ns);
+  uint64_t GetNextReleaseTime() const { return next_release_ns_; }
+
+  // True once after the hold goes from empty to non-empty, so the caller can
+  // make sure something will call ReleaseHeld() later.
+  bool TakeReleaseRequest();
+
+  // Tracer for sampled commands, or nullptr when tracing is off.
+  void SetTracer(CommandTracer* tracer) { tracer_ = tracer; }
+
+  // Checks SIOCOUTQ and ends the "in flight" span of every traced command the
+  // kernel has seen acknowledged.
+  void PollAcks();
+  bool HasTracesInFlight() const { return !traced_in_flight_.empty(); }
+
+  // In batching mode Send() only stages commands; Flush() writes everything
+  // staged since the last flush in a single write(), so each roomba gets one
+  // TCP segment per control tick. Enabling batching also sets TCP_NODELAY so
+  // that flush is never held back by Nagle. Disabling it flushes first.
+  void SetBatching(bool enabled);
+  bool Flush();
+
+  // Returns this client's counters, with |segments| read from the kernel.
+  SendStats GetSendStats() const;
+
+  // Reads everything waiting on the socket and decodes the sensor stream into
+  // this client's state. Returns the number of complete sensor frames decoded,
+  // or -1 if the remote end closed the connection or the read failed.
+  int Receive();
+
+  // Picks up state carried over from a previous process (hot restart).
+  void RestoreState(const RoombaState& state);
+
+  // Session handling for identified roombas. Detach() closes the socket but
+  // keeps the slot, state and held commands; Attach() resumes them on a new
+  // connection and releases the held commands through the pacer.
+  void Detach();
+  void Attach(int socket, uint32_t connection_id);
+  // Restores a session handed over while detached (hot restart), keeping the
+  // time it was detached at so its grace period doesn't restart.
+  void RestoreDetached(uint64_t detached_at_ns);
+  bool IsAttached() const { return socket_ >= 0; }
+  uint64_t GetDetachedAt() const { return detached_at_ns_; }
+
+  // Gives up ownership of the socket without closing it.
+  int ReleaseSocket();
+
+  // Treats the first line received as a "HELLO <id>\n" announcement until it
+  // arrives, non-hello data arrives, or CancelHello() is called.
+  void ExpectHello(uint64_t deadline_ns);
+  void CancelHello() { awaiting_hello_ = false; }
+  bool IsAwaitingHello() const { return awaiting_hello_; }
+  uint64_t GetHelloDeadline() const { return hello_deadline_ns_; }
+  // The announced id, or empty if the roomba didn't send a valid hello.
+  const std::string& GetHelloId() const { return hello_id_; }
+
+  // Stable identity of this roomba, empty if unknown.
+  const std::string& GetId() const { return id_; }
+  void SetId(const std::string& id) { id_ = id; }
+  // Moves the odometry pose into the arena frame, starting at |pose|.
+  void SetStartPose(const RoombaPose& pose);
+
+  int GetSocket() const { return socket_; }
+  size_t GetSlot() const { return slot_; }
+  uint32_t GetConnectionId() const { return connection_id_; }
+  const RoombaState& GetState() const { return state_; }
 
  private:
-  int socket_ = 0;
+  static void OnSensorPacket(const oi::SensorPacket& packet, void* userdata);
+  static void OnSensorFrame(void* userdata);
+
+  void UpdateOdometry(uint16_t left, uint16_t right);
+
+  // Consumes the hello line from the start of |data|. Returns the number of
+  // bytes used; the rest belongs to the sensor stream.
+  size_t ParseHello(const uint8_t* data, size_t len);
+
+  bool SendAdmitted(const void* data, size_t len, uint64_t cmd_id);
+  bool Hold(const void* data, size_t len, uint64_t cmd_id, uint64_t now_ns);
+  bool WritePending();
+  void SetCork(bool cork);
+  void AddInFlight(uint64_t cmd_id, uint64_t end_offset, uint64_t sent_ns);
+
+  // Staged bytes beyond this are spilled early (under TCP_CORK) mid-tick.
+  static const size_t kMaxStagedBytes = 1024;
+
+  int socket_ = -1;
+  size_t slot_ = 0;
+  uint32_t connection_id_ = 0;
+  std::string id_;
+  uint64_t detached_at_ns_ = 0;
+
+  bool awaiting_hello_ = false;
+  uint64_t hello_deadline_ns_ = 0;
+  std::string hello_line_;
+  std::string hello_id_;
   sockaddr_in client_addr_;
+
+  oi::StreamParser parser_;
+  RoombaState state_;
+  bool have_encoders_ = false;
+  uint16_t pending_left_ = 0;
+  uint16_t pending_right_ = 0;
+
+  bool batching_ = false;
+  bool corked_ = false;
+  std::vector<uint8_t> staged_;
+  SendStats stats_;
+
+  // A traced command, located by the stream offset just past its last byte.
+  struct TracedCommand {
+    uint64_t cmd_id;
+    uint64_t end_offset;
+    uint64_t start_ns;  // when it was staged, or when its write finished
+  };
+
+  // Most traced commands we keep waiting for an acknowledgement.
+  static const size_t kMaxTracesInFlight = 256;
+
+  // A command waiting for serial pacing tokens.
+  struct HeldCommand {
+    oi::CoalesceClass coalesce_class;
+    std::vector<uint8_t> bytes;
+    uint64_t cmd_id;
+    uint64_t held_ns;
+  };
+
+  // Beyond this many held commands, new ones are refused.
+  static const size_t kMaxHeldCommands = 64;
+
+  TokenBucket pacer_;
+  std::deque<HeldCommand> held_;
+  uint64_t next_release_ns_ = 0;
+  bool release_requested_ = false;
+
+  CommandTracer* tracer_ = nullptr;
+  uint64_t socket_bytes_ = 0;  // bytes written to the current socket
+  std::vector<TracedCommand> traced_staged_;
+  std::vector<TracedCommand> traced_in_flight_;
 };
 
-#endif  // _ROOMBA_CLIENT_H_
\ No newline at end of file
+#endif  // _ROOMBA_CLIENT_H_
@@ -0,0 +1,161 @@
+#include "roomba_identity.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+static std::string ToLower(std::string s) {
+  for (auto& c : s) {
+    c = char(std::tolower((unsigned char)c));
+  }
+  return s;
+}
+
+// Finds the hardware address for |ip| in /proc/net/arp.
+static std::string LookupMac(const std::string& ip) {
+  FILE* file = fopen("/proc/net/arp", "r");
+  if (!file) {
+    return std::string();
+  }
+
+  char line[256];
+  std::string mac;
+  // Skip the header line.
+  if (fgets(line, sizeof(line), file)) {
+    while (fgets(line, sizeof(line), file)) {
+      char entry_ip[64], hw_type[16], flags[16], hw_addr[64];
+      if (sscanf(line, "%63s %15s %15s %63s", entry_ip, hw_type, flags,
+                 hw_addr) == 4 &&
+          ip == entry_ip) {
+        mac = ToLower(hw_addr);
+        break;
+      }
+    }
+  }
+
+  fclose(file);
+  return mac;
+}
+
+bool IsValidRoombaId(const std::string& id) {
+  if (id.empty() || id.size() > kMaxRoombaIdLength) {
+    return false;
+  }
+
+  for (char c : id) {
+    if (!std::isalnum((unsigned char)c) && c != '_' && c != '.' && c != ':' &&
+        c != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RoombaIdentityMap::Load(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    printf("Failed to open roomba map %s\n", path);
+    return false;
+  }
+
+  char line[256];
+  int line_num = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_num++;
+
+    char address[64], id[64], model[64];
+    int n = sscanf(line, "%63s %63s %63s", address, id, model);
+    if (n <= 0 || address[0] == '#') {
+      continue;
+    }
+
+    if (std::strcmp(address, "pose") == 0) {
+      float heading_deg;
+      RoombaPose pose;
+      if (sscanf(line, "%*s %63s %f %f %f", id, &pose.x_mm, &pose.y_mm,
+                 &heading_deg) != 4 ||
+          !IsValidRoombaId(id)) {
+        printf("%s:%d: expected \"pose <id> <x mm> <y mm> <heading deg>\"\n",
+               path, line_num);
+        continue;
+      }
+
+      pose.theta_rad = heading_deg * float(M_PI) / 180.0f;
+      SetStartPose(id, pose);
+      continue;
+    }
+
+    if (n < 2 || !IsValidRoombaId(id)) {
+      printf("%s:%d: expected \"<ip or mac> <id> [model]\"\n", path,
+             line_num);
+      continue;
+    }
+
+    Add(address, id);
+    if (n == 3 && model[0] != '#') {
+      SetModel(id, model);
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+void RoombaIdentityMap::Add(const std::string& address, const std::string& id) {
+  ids_[ToLower(address)] = id;
+}
+
+void RoombaIdentityMap::SetModel(const std::string& id,
+                                 const std::string& model) {
+  models_[id] = ToLower(model);
+}
+
+void RoombaIdentityMap::SetStartPose(const std::string& id,
+                                     const RoombaPose& pose) {
+  poses_[id] = pose;
+}
+
+std::string RoombaIdentityMap::GetModel(const std::string& id) const {
+  auto it = models_.find(id);
+  return it != models_.end() ? it->second : std::string();
+}
+
+bool RoombaIdentityMap::GetStartPose(const std::string& id,
+                                     RoombaPose* pose) const {
+  auto it = poses_.find(id);
+  if (it == poses_.end()) {
+    return false;
+  }
+
+  *pose = it->second;
+  return true;
+}
+
+std::string RoombaIdentityMap::Resolve(const sockaddr_in& addr) const {
+  if (ids_.empty()) {
+    return std::string();
+  }
+
+  char ip[INET_ADDRSTRLEN];
+  if (!inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip))) {
+    return std::string();
+  }
+
+  auto it = ids_.find(ip);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+
+  std::string mac = LookupMac(ip);
+  if (!mac.empty()) {
+    it = ids_.find(mac);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+  }
+
+  return std::string();
+}
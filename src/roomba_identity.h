@@ -0,0 +1,60 @@
+#ifndef _ROOMBA_IDENTITY_H_
+#define _ROOMBA_IDENTITY_H_
+
+#include <map>
+#include <string>
+
+#include <netinet/in.h>
+
+// Longest roomba id we accept, from either the hello line or the map file.
+const size_t kMaxRoombaIdLength = 31;
+
+// Where a roomba starts out in the shared arena frame.
+struct RoombaPose {
+  float x_mm;
+  float y_mm;
+  float theta_rad;
+};
+
+// Maps a connecting roomba's IP or MAC address to a stable id, for bridges
+// that don't announce themselves with a hello line, and optionally an id to a
+// robot model (which sets the serial rate commands are paced to) and a start
+// pose (which puts its odometry in the shared arena frame).
+class RoombaIdentityMap {
+ public:
+  // Loads a file of "<ip or mac> <id> [model]" and
+  // "pose <id> <x mm> <y mm> <heading deg>" lines. Blank lines and lines
+  // starting with '#' are ignored. Returns false if the file can't be read.
+  bool Load(const char* path);
+
+  void Add(const std::string& address, const std::string& id);
+  void SetModel(const std::string& id, const std::string& model);
+  void SetStartPose(const std::string& id, const RoombaPose& pose);
+
+  // Returns the model of roomba |id|, or an empty string if not configured.
+  std::string GetModel(const std::string& id) const;
+  // Copies the start pose of roomba |id| into |pose|. Returns false if it
+  // has none.
+  bool GetStartPose(const std::string& id, RoombaPose* pose) const;
+  bool HasStartPoses() const { return !poses_.empty(); }
+
+  // Looks |addr| up by IP, then by the MAC the kernel's ARP cache has for it.
+  // Returns an empty string if neither is mapped.
+  std::string Resolve(const sockaddr_in& addr) const;
+
+  bool IsEmpty() const { return ids_.empty(); }
+
+ private:
+  // Address (IPs as dotted quads, MACs lowercase) -> id.
+  std::map<std::string, std::string> ids_;
+  // Id -> robot model.
+  std::map<std::string, std::string> models_;
+  // Id -> start pose.
+  std::map<std::string, RoombaPose> poses_;
+};
+
+// Returns true if |id| is a usable roomba id: 1 to kMaxRoombaIdLength
+// characters from [A-Za-z0-9_.:-].
+bool IsValidRoombaId(const std::string& id);
+
+#endif  // _ROOMBA_IDENTITY_H_
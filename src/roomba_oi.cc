@@ -0,0 +1,155 @@
+#include "roomba_oi.h"
+
+#include <cstring>
+
+namespace oi {
+
+const uint8_t kStreamPackets[] = {
+    kPacketBumpsWheelDrops, kPacketVoltage,         kPacketCurrent,
+    kPacketBatteryCharge,   kPacketBatteryCapacity, kPacketEncoderLeft,
+    kPacketEncoderRight,
+};
+const size_t kNumStreamPackets = sizeof(kStreamPackets);
+
+uint32_t GetModelBaud(const char* model) {
+  static const struct {
+    const char* name;
+    uint32_t baud;
+  } kModels[] = {
+      {"create2", 115200},   {"roomba500", 115200}, {"roomba600", 115200},
+      {"roomba700", 115200}, {"roomba800", 115200}, {"create1", 57600},
+      {"roomba400", 57600},
+  };
+
+  for (auto& m : kModels) {
+    if (std::strcmp(model, m.name) == 0) {
+      return m.baud;
+    }
+  }
+  return 0;
+}
+
+CoalesceClass GetCoalesceClass(const uint8_t* data, size_t len) {
+  if (len == 0) {
+    return kCoalesceNone;
+  }
+
+  switch (data[0]) {
+    case kDrive:
+    case kDriveDirect:
+    case kDrivePwm:
+      return len == 5 ? kCoalesceDrive : kCoalesceNone;
+    case kLeds:
+      return len == 4 ? kCoalesceLeds : kCoalesceNone;
+    default:
+      return kCoalesceNone;
+  }
+}
+
+size_t GetPacketSize(uint8_t id) {
+  switch (id) {
+    case kPacketBumpsWheelDrops:
+      return 1;
+    case kPacketVoltage:
+    case kPacketCurrent:
+    case kPacketBatteryCharge:
+    case kPacketBatteryCapacity:
+    case kPacketEncoderLeft:
+    case kPacketEncoderRight:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+size_t EncodeStartSequence(uint8_t* out) {
+  size_t n = 0;
+  out[n++] = kStart;
+  out[n++] = kSafe;
+  out[n++] = kStream;
+  out[n++] = uint8_t(kNumStreamPackets);
+  std::memcpy(out + n, kStreamPackets, kNumStreamPackets);
+  return n + kNumStreamPackets;
+}
+
+void EncodeDriveDirect(int16_t right_mm_s, int16_t left_mm_s, uint8_t* out) {
+  out[0] = kDriveDirect;
+  out[1] = uint8_t(uint16_t(right_mm_s) >> 8);
+  out[2] = uint8_t(right_mm_s);
+  out[3] = uint8_t(uint16_t(left_mm_s) >> 8);
+  out[4] = uint8_t(left_mm_s);
+}
+
+size_t StreamParser::Feed(const uint8_t* data, size_t len, PacketFn fn,
+                          void (*frame_fn)(void* userdata), void* userdata) {
+  size_t num_frames = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = data[i];
+    switch (state_) {
+      case kWaitHeader:
+        if (b == kStreamHeader) {
+          checksum_ = b;
+          state_ = kWaitLength;
+        }
+        break;
+      case kWaitLength:
+        frame_len_ = b;
+        frame_pos_ = 0;
+        checksum_ += b;
+        state_ = kPayload;
+        break;
+      case kPayload:
+        checksum_ += b;
+        if (frame_pos_ < frame_len_) {
+          frame_[frame_pos_++] = b;
+          break;
+        }
+
+        // This is the checksum byte; the sum of the whole frame must be 0.
+        state_ = kWaitHeader;
+        if (checksum_ != 0) {
+          num_bad_frames_++;
+          break;
+        }
+
+        DecodeFrame(fn, userdata);
+        if (frame_fn) {
+          frame_fn(userdata);
+        }
+        num_frames++;
+        break;
+    }
+  }
+
+  return num_frames;
+}
+
+void StreamParser::DecodeFrame(PacketFn fn, void* userdata) {
+  size_t pos = 0;
+  while (pos < frame_len_) {
+    uint8_t id = frame_[pos++];
+    size_t size = GetPacketSize(id);
+    if (size == 0 || pos + size > frame_len_) {
+      // Unknown packet; we can't tell how long it is so skip the rest.
+      num_bad_frames_++;
+      return;
+    }
+
+    SensorPacket packet;
+    packet.id = id;
+    if (size == 1) {
+      packet.value = frame_[pos];
+    } else if (id == kPacketCurrent) {
+      packet.value = int16_t((frame_[pos] << 8) | frame_[pos + 1]);
+    } else {
+      packet.value = uint16_t((frame_[pos] << 8) | frame_[pos + 1]);
+    }
+    pos += size;
+
+    if (fn) {
+      fn(packet, userdata);
+    }
+  }
+}
+
+}  // namespace oi
@@ -0,0 +1,109 @@
+#ifndef _ROOMBA_OI_H_
+#define _ROOMBA_OI_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Constants and helpers for the iRobot Create 2 / Roomba Open Interface (OI).
+
+namespace oi {
+
+enum Opcode : uint8_t {
+  kStart = 128,
+  kSafe = 131,
+  kFull = 132,
+  kDrive = 137,
+  kLeds = 139,
+  kDriveDirect = 145,
+  kDrivePwm = 146,
+  kStream = 148,
+  kPauseResumeStream = 150,
+};
+
+enum PacketId : uint8_t {
+  kPacketBumpsWheelDrops = 7,
+  kPacketVoltage = 22,
+  kPacketCurrent = 23,
+  kPacketBatteryCharge = 25,
+  kPacketBatteryCapacity = 26,
+  kPacketEncoderLeft = 43,
+  kPacketEncoderRight = 44,
+};
+
+// First byte of every sensor stream frame.
+const uint8_t kStreamHeader = 19;
+
+// Drive geometry of the Create 2, used for odometry.
+const float kWheelDiameterMm = 72.0f;
+const float kWheelBaseMm = 235.0f;
+const float kCountsPerRev = 508.8f;
+
+// Serial link between the Wi-Fi bridge and the roomba. Commands can't reach
+// the robot faster than this, whatever TCP manages.
+const uint32_t kDefaultBaud = 115200;
+
+// Looks up the OI default baud rate of a robot model ("create2", "create1",
+// "roomba500", ...). Returns 0 for unknown models.
+uint32_t GetModelBaud(const char* model);
+
+// Payload bytes per second at |baud| with 8N1 framing.
+inline uint32_t BaudToBytesPerSecond(uint32_t baud) { return baud / 10; }
+
+// Commands that fully replace any earlier command of the same class, so an
+// older one still waiting to be sent can be dropped in favor of the newer.
+enum CoalesceClass { kCoalesceNone, kCoalesceDrive, kCoalesceLeds };
+
+// Classifies |data| if it is exactly one coalescable command.
+CoalesceClass GetCoalesceClass(const uint8_t* data, size_t len);
+
+// Returns the payload size of sensor packet |id|, or 0 if we don't know it.
+size_t GetPacketSize(uint8_t id);
+
+// The sensor packets the master asks every roomba to stream.
+extern const uint8_t kStreamPackets[];
+extern const size_t kNumStreamPackets;
+
+// Writes Start, Safe and a Stream request for kStreamPackets into |out|.
+// Returns the number of bytes written (|out| must hold at least 32 bytes).
+size_t EncodeStartSequence(uint8_t* out);
+
+// Writes a 5-byte Drive Direct frame. Velocities are in mm/s, -500 to 500.
+void EncodeDriveDirect(int16_t right_mm_s, int16_t left_mm_s, uint8_t* out);
+
+// One decoded sensor packet.
+struct SensorPacket {
+  uint8_t id;
+  int32_t value;
+};
+
+// Incremental parser for the OI sensor stream. Bytes can be fed in arbitrary
+// chunks; frames with a bad checksum are dropped and the parser resyncs on the
+// next header byte.
+class StreamParser {
+ public:
+  typedef void (*PacketFn)(const SensorPacket& packet, void* userdata);
+
+  // Feeds |len| bytes, calling |fn| for each packet of every valid frame and
+  // |frame_fn| once after each valid frame (either may be null). Returns the
+  // number of valid frames completed.
+  size_t Feed(const uint8_t* data, size_t len, PacketFn fn,
+              void (*frame_fn)(void* userdata), void* userdata);
+
+  size_t GetNumBadFrames() const { return num_bad_frames_; }
+
+ private:
+  void DecodeFrame(PacketFn fn, void* userdata);
+
+  enum State { kWaitHeader, kWaitLength, kPayload };
+
+  State state_ = kWaitHeader;
+  uint8_t frame_len_ = 0;
+  uint8_t frame_pos_ = 0;
+  uint8_t checksum_ = 0;
+  uint8_t frame_[256];
+  size_t num_bad_frames_ = 0;
+};
+
+}  // namespace oi
+
+#endif  // _ROOMBA_OI_H_
@@ -1,19 +1,37 @@
 #include "roomba_server.h"
 
+#include "hot_restart.h"
+#include "clock.h"
 #include "logging.h"
 
 #include <algorithm>
 #include <cstring>
+#include <string>
 
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// epoll tokens. Clients use their slot and connection id, so an event for a
+// connection that has since been replaced can be recognized and ignored.
+static const uint64_t kListenToken = ~uint64_t(0);
+static const uint64_t kTerminationToken = ~uint64_t(0) - 1;
+static const uint64_t kWakeToken = ~uint64_t(0) - 2;
+
+// Bytes a roomba may be sent back to back before serial pacing kicks in,
+// roughly what a Wi-Fi bridge's UART FIFO absorbs.
+static const uint32_t kSerialBurstBytes = 128;
+
+static uint64_t ClientToken(const RoombaClient *client) {
+  return (uint64_t(client->GetSlot()) << 32) | client->GetConnectionId();
+}
+
 static int SetBlocking(int socket, int blocking) {
   int flags = fcntl(socket, F_GETFL, 0);
   if (flags == -1) {
@@ -36,6 +54,8 @@ static int SetBlocking(int socket, int blocking) {
   return 0;
 }
 
+RoombaServer::RoombaServer(size_t max_roombas) : state_store_(max_roombas) {}
+
 bool RoombaServer::Initialize(uint16_t port) {
   listen_socket_ = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_socket_ < 0) {
@@ -70,14 +90,119 @@ bool RoombaServer::Initialize(uint16_t port) {
     return false;
   }
 
+  return StartWorker();
+}
+
+bool RoombaServer::InitializeFromHandoff(int channel) {
+  std::vector<HandoffClient> handoff;
+  if (!ReceiveHandoff(channel, &listen_socket_, &handoff)) {
+    printf("Failed to receive the handoff from the previous process!\n");
+    return false;
+  }
+
+  SetBlocking(listen_socket_, 0);
+  size_t num_detached = 0;
+  for (auto &h : handoff) {
+    if (h.slot >= state_store_.GetCapacity()) {
+      printf("Roomba in slot %u is beyond our capacity, dropping it.\n",
+             h.slot);
+      if (h.socket >= 0) {
+        close(h.socket);
+      }
+      continue;
+    }
+
+    auto *client = new RoombaClient(h.socket, h.slot, next_connection_id_++);
+    client->SetId(h.id);
+    ConfigurePacing(client);
+    client->RestoreState(h.state);
+    if (h.socket < 0) {
+      client->RestoreDetached(h.detached_at_ns);
+      num_detached++;
+    }
+    client->RestoreHeld(h.held, h.pacer_tokens);
+    AddClient(client);
+    state_store_.Write(client->GetSlot(), client->GetState());
+  }
+
+  printf("Resumed %zu roomba connections and %zu waiting sessions.\n",
+         clients_.size() - num_detached, num_detached);
+  return StartWorker();
+}
+
+bool RoombaServer::HandOff(int channel) {
+  StopWorker();
+
+  // The new process can't pick up a half-finished hello wait.
+  for (auto client : clients_) {
+    if (client->IsAwaitingHello()) {
+      client->CancelHello();
+      SendStartSequence(client);
+    }
+  }
+
+  std::vector<HandoffClient> handoff;
+  {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    for (auto client : clients_) {
+      // Staged commands already have their pacing tokens, so they go out
+      // now. Held ones travel with the session, along with the pacer's
+      // level, and the new process paces them out.
+      if (client->IsAttached()) {
+        client->Flush();
+      }
+
+      HandoffClient h;
+      h.socket = client->GetSocket();
+      h.detached_at_ns = client->GetDetachedAt();
+      h.slot = uint32_t(client->GetSlot());
+      h.id = client->GetId();
+      h.state = client->GetState();
+      client->ExportHeld(&h.held, &h.pacer_tokens);
+      handoff.push_back(h);
+    }
+  }
+
+  bool handed_off = SendHandoff(channel, listen_socket_, handoff);
+  if (!handed_off) {
+    close(channel);
+    printf("Hot restart handoff failed, resuming service.\n");
+  } else if (!WaitForSuccessor(channel)) {
+    // Our copies of every descriptor are still open, so nothing was lost.
+    handed_off = false;
+    printf("The new process failed to acknowledge the handoff, resuming "
+           "service.\n");
+  }
+
+  if (!handed_off) {
+    // The successor may have bound the ingress path before giving up.
+    if (!ingress_.Relisten()) {
+      printf("Planners can no longer connect; connected ones carry on.\n");
+    }
+    worker_thread_ = std::thread(&RoombaServer::WorkerThreadFn, this);
+    return false;
+  }
+
+  // The new process holds its own references now, so closing ours leaves the
+  // connections up.
+  CloseAll(false);
+  return true;
+}
+
+void RoombaServer::Abandon() {
+  StopWorker();
+  CloseAll(false);
+}
+
+bool RoombaServer::StartWorker() {
   // Setup epoll.
   efd_ = epoll_create1(0);
 
   // Add the listen socket to epoll's list.
   epoll_event evt;
-  evt.data.fd = listen_socket_;
+  evt.data.u64 = kListenToken;
   evt.events = EPOLLIN | EPOLLET;  // Input, edge-triggered
-  status = epoll_ctl(efd_, EPOLL_CTL_ADD, listen_socket_, &evt);
+  int status = epoll_ctl(efd_, EPOLL_CTL_ADD, listen_socket_, &evt);
   if (status == -1) {
     PERROR("Failed to add listen socket to epoll list. errno = %s\n",
            strerror(errno));
@@ -90,7 +215,7 @@ bool RoombaServer::Initialize(uint16_t port) {
     return false;
   }
 
-  evt.data.fd = termination_pipe_[0];
+  evt.data.u64 = kTerminationToken;
   evt.events = EPOLLIN | EPOLLET;
   status = epoll_ctl(efd_, EPOLL_CTL_ADD, termination_pipe_[0], &evt);
   if (status == -1) {
@@ -99,6 +224,29 @@ bool RoombaServer::Initialize(uint16_t port) {
     return false;
   }
 
+  // Other threads poke this when the worker has new timed work (see Wake()).
+  wake_fd_ = eventfd(0, EFD_NONBLOCK);
+  evt.data.u64 = kWakeToken;
+  evt.events = EPOLLIN | EPOLLET;
+  status = epoll_ctl(efd_, EPOLL_CTL_ADD, wake_fd_, &evt);
+  if (status == -1) {
+    PERROR("Failed to add wake eventfd to epoll list. errno = %s\n",
+           strerror(errno));
+    return false;
+  }
+
+  if (!ingress_path_.empty() && !ingress_.Start(ingress_path_, efd_)) {
+    return false;
+  }
+
+  // Clients handed over from a previous process. Anything they sent in the
+  // meantime is already readable, which epoll reports as soon as we add them.
+  for (auto client : clients_) {
+    if (client->IsAttached()) {
+      AddToEpoll(client, EPOLL_CTL_ADD);
+    }
+  }
+
   // Handle up to 5 events at a time.
   events_.resize(5);
 
@@ -107,10 +255,24 @@ bool RoombaServer::Initialize(uint16_t port) {
   return true;
 }
 
-void RoombaServer::Shutdown() {
-  write(termination_pipe_[1], "bye", 4);
+void RoombaServer::StopWorker() {
+  if (!worker_thread_.joinable()) {
+    return;
+  }
 
+  write(termination_pipe_[1], "bye", 4);
   worker_thread_.join();
+}
+
+void RoombaServer::Shutdown() {
+  StopWorker();
+  CloseAll(true);
+}
+
+void RoombaServer::CloseAll(bool mark_disconnected) {
+  // A successor taking over from us reuses the ingress socket path.
+  ingress_.Stop(mark_disconnected);
+
   if (efd_ != -1) {
     close(efd_);
     efd_ = -1;
@@ -121,126 +283,623 @@ void RoombaServer::Shutdown() {
     listen_socket_ = -1;
   }
 
-  close(termination_pipe_[0]);
-  close(termination_pipe_[1]);
+  if (termination_pipe_[0] != -1) {
+    close(termination_pipe_[0]);
+    close(termination_pipe_[1]);
+    termination_pipe_[0] = termination_pipe_[1] = -1;
+  }
+
+  if (wake_fd_ != -1) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
 
+  std::lock_guard<std::mutex> lock(client_mutex_);
   for (auto client : clients_) {
+    if (mark_disconnected) {
+      RoombaState state = client->GetState();
+      state.connected = 0;
+      state_store_.Write(client->GetSlot(), state);
+    }
+
     client->Close();
     delete client;
   }
   clients_.clear();
+  clients_by_slot_.clear();
+  clients_by_id_.clear();
 }
 
 void RoombaServer::Broadcast(void *data, size_t len) {
+  uint64_t cmd_id = tracer_.Sample();
+  uint64_t start_ns = cmd_id ? NowNs() : 0;
+
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  if (cmd_id) {
+    tracer_.Span("lock wait", start_ns, NowNs(), cmd_id);
+  }
+
+  bool wake = false;
+  for (auto client : clients_) {
+    client->Send(data, len, cmd_id);
+    wake |= client->TakeReleaseRequest();
+  }
+
+  if (wake) {
+    Wake();
+  }
+
+  if (cmd_id) {
+    tracer_.Span("Broadcast", start_ns, NowNs(), cmd_id);
+  }
+}
+
+bool RoombaServer::Send(size_t slot, const void *data, size_t len) {
+  uint64_t cmd_id = tracer_.Sample();
+  uint64_t start_ns = cmd_id ? NowNs() : 0;
+
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  if (cmd_id) {
+    tracer_.Span("lock wait", start_ns, NowNs(), cmd_id, int(slot));
+  }
+
+  if (slot >= clients_by_slot_.size() || clients_by_slot_[slot] == nullptr) {
+    return false;
+  }
+
+  bool ok = clients_by_slot_[slot]->Send(data, len, cmd_id);
+  if (clients_by_slot_[slot]->TakeReleaseRequest()) {
+    Wake();
+  }
+
+  if (cmd_id) {
+    tracer_.Span("Send", start_ns, NowNs(), cmd_id, int(slot));
+  }
+  return ok;
+}
+
+size_t RoombaServer::SendEach(const uint8_t *frames, size_t frame_len,
+                              size_t num) {
+  size_t sent = 0;
+  bool wake = false;
+
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  num = std::min(num, clients_by_slot_.size());
+  for (size_t slot = 0; slot < num; slot++) {
+    RoombaClient *client = clients_by_slot_[slot];
+    if (client == nullptr) {
+      continue;
+    }
+
+    uint64_t cmd_id = tracer_.Sample();
+    uint64_t start_ns = cmd_id ? NowNs() : 0;
+    if (client->Send(frames + slot * frame_len, frame_len, cmd_id)) {
+      sent++;
+    }
+    wake |= client->TakeReleaseRequest();
+    if (cmd_id) {
+      tracer_.Span("Send", start_ns, NowNs(), cmd_id, int(slot));
+    }
+  }
+
+  if (wake) {
+    Wake();
+  }
+  return sent;
+}
+
+void RoombaServer::SetTickBatching(bool enabled) {
   std::lock_guard<std::mutex> lock(client_mutex_);
+  tick_batching_ = enabled;
   for (auto client : clients_) {
-    client->Send(data, len);
+    client->SetBatching(enabled);
   }
 }
 
+void RoombaServer::FlushTick() {
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  if (!tick_batching_) {
+    return;
+  }
+
+  for (auto client : clients_) {
+    client->Flush();
+  }
+}
+
+SendStats RoombaServer::GetSendStats() {
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  SendStats stats = retired_stats_;
+  for (auto client : clients_) {
+    stats += client->GetSendStats();
+  }
+  return stats;
+}
+
 size_t RoombaServer::GetNumClients() {
   std::lock_guard<std::mutex> lock(client_mutex_);
-  return clients_.size();
+  return std::count_if(clients_.begin(), clients_.end(),
+                       [](RoombaClient *c) { return c->IsAttached(); });
+}
+
+void RoombaServer::Wake() {
+  uint64_t one = 1;
+  write(wake_fd_, &one, sizeof(one));
+}
+
+void RoombaServer::ConfigurePacing(RoombaClient *client) {
+  uint32_t baud = serial_baud_;
+  std::string model = identity_map_.GetModel(client->GetId());
+  if (!model.empty()) {
+    baud = oi::GetModelBaud(model.c_str());
+    if (baud == 0) {
+      printf("Unknown model %s for roomba %s, assuming %u baud.\n",
+             model.c_str(), client->GetId().c_str(), serial_baud_);
+      baud = serial_baud_;
+    }
+  }
+
+  client->SetPacing(oi::BaudToBytesPerSecond(baud), kSerialBurstBytes);
+}
+
+void RoombaServer::PlaceAtStartPose(RoombaClient *client) {
+  RoombaPose pose;
+  if (identity_map_.GetStartPose(client->GetId(), &pose)) {
+    client->SetStartPose(pose);
+  }
+}
+
+void RoombaServer::AddClient(RoombaClient *client) {
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  clients_.push_back(client);
+
+  size_t slot = client->GetSlot();
+  if (slot >= clients_by_slot_.size()) {
+    clients_by_slot_.resize(slot + 1, nullptr);
+  }
+  clients_by_slot_[slot] = client;
+  if (!client->GetId().empty()) {
+    clients_by_id_[client->GetId()] = client;
+  }
+  client->SetBatching(tick_batching_);
+  client->SetTracer(tracer_.IsEnabled() ? &tracer_ : nullptr);
+}
+
+void RoombaServer::RemoveClient(RoombaClient *client) {
+  // Unlink the client before touching it, so no sender can reach it while we
+  // close its socket (whose fd number could otherwise be reused under them).
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  clients_.erase(std::remove(clients_.begin(), clients_.end(), client),
+                 clients_.end());
+  clients_by_slot_[client->GetSlot()] = nullptr;
+  auto by_id = clients_by_id_.find(client->GetId());
+  if (by_id != clients_by_id_.end() && by_id->second == client) {
+    clients_by_id_.erase(by_id);
+  }
+
+  SendStats stats = client->GetSendStats();
+  // Whatever it still held is gone with it.
+  stats.paced_held_now = 0;
+  retired_stats_ += stats;
+  client->Close();
+
+  // Mark the slot as free for readers before anyone else can reuse it.
+  RoombaState state = client->GetState();
+  state.connected = 0;
+  state_store_.Write(client->GetSlot(), state);
+  delete client;
+}
+
+int RoombaServer::AllocateSlot() {
+  // Only the worker thread modifies clients_by_slot_, so it can read it here
+  // without the lock. The slot is claimed when the client is registered.
+  for (size_t i = 0; i < clients_by_slot_.size(); i++) {
+    if (clients_by_slot_[i] == nullptr) {
+      return int(i);
+    }
+  }
+
+  if (clients_by_slot_.size() >= state_store_.GetCapacity()) {
+    return -1;
+  }
+
+  return int(clients_by_slot_.size());
 }
 
 void RoombaServer::WorkerThreadFn() {
-  epoll_event evt;
-  int status;
+  if (rt_config_.IsEnabled()) {
+    ApplyRealtimeConfig(rt_config_);
+  }
 
   while (true) {
-    int n = epoll_wait(efd_, events_.data(), events_.size(), -1);
+    int n = epoll_wait(efd_, events_.data(), events_.size(),
+                       GetWorkerTimeoutMs());
     for (int i = 0; i < n; i++) {
+      uint64_t token = events_[i].data.u64;
+      if (token == kTerminationToken) {
+        // Termination signalled.
+        return;
+      } else if (token == kWakeToken) {
+        // Just re-evaluate timers below.
+        uint64_t count;
+        read(wake_fd_, &count, sizeof(count));
+        continue;
+      } else if (token == kListenToken) {
+        // New client(s) connected.
+        AcceptClients();
+        continue;
+      } else if (ShmIngress::IsToken(token)) {
+        // A planner connected, rang its doorbell or hung up.
+        HandleIngressEvent(token, events_[i].events);
+        continue;
+      }
+
+      RoombaClient *client = LookupClient(token);
+      if (client == nullptr) {
+        // Stale event for a connection we've already replaced.
+        continue;
+      }
+
       if ((events_[i].events & EPOLLERR) || (events_[i].events & EPOLLHUP) ||
           !(events_[i].events & EPOLLIN)) {
         // Error on this socket.
-        // TODO: Close the socket and terminate the client.
-        printf("Error on socket described by %p\n", events_[i].data.ptr);
-
-        if (events_[i].data.ptr != nullptr) {
-          auto *client = reinterpret_cast<RoombaClient *>(events_[i].data.ptr);
-          client->Close();
-
-          // Erase the client from our vector.
-          clients_.erase(std::remove(clients_.begin(), clients_.end(), client),
-                         clients_.end());
-          delete client;
-        }
-      } else if (events_[i].data.fd == listen_socket_) {
-        // New client(s) connected. Loop and connect until we run out of new
-        // clients.
-        while (1) {
-          sockaddr_in client_addr;
-          socklen_t client_len = sizeof(client_addr);
-
-          int sock =
-              accept(listen_socket_, (sockaddr *)&client_addr, &client_len);
-          if (sock < 0) {
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-              // We've finished processing incoming connections.
-              break;
-            } else {
-              printf("Error on accept! errno = %s\n", strerror(errno));
-              break;
-            }
-          }
-
-          SetBlocking(sock, 0);
-
-          char hbuf[NI_MAXHOST], sbuf[NI_MAXHOST];
-          status = getnameinfo((const sockaddr *)&client_addr, client_len, hbuf,
-                               sizeof(hbuf), sbuf, sizeof(sbuf),
-                               NI_NUMERICHOST | NI_NUMERICSERV);
-          if (status == 0) {
-            printf("New connection accepted from %s:%s\n", hbuf, sbuf);
-          } else {
-            printf("New connection accepted!\n");
-          }
-
-          auto *client = new RoombaClient(sock);
-          evt.data.ptr = client;
-          evt.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-          status = epoll_ctl(efd_, EPOLL_CTL_ADD, sock, &evt);
-          if (status == -1) {
-            printf("epoll_ctl failed, errno = %s\n", strerror(errno));
-            delete client;
-            continue;
-          }
-
-          // Drive forward
-          /*
-          const char data[] = "\x89\x01\xf4\x80\x00";
-          client->Send(data, sizeof(data) - 1);
-          */
-
-          // Rotate (0x01F4 full speed, 0x0000 rotate -max)
-          const char data[] = "\x89\x01\xf4\x00\x00";
-          client->Send(data, sizeof(data) - 1);
-
-          std::lock_guard<std::mutex> lock(client_mutex_);
-          // Register the client internally.
-          clients_.push_back(client);
-        }
+        printf("Error on socket of roomba in slot %zu\n", client->GetSlot());
+        DropConnection(client);
       } else if (events_[i].events & EPOLLRDHUP) {
         // Remote hangup.
-        printf("Remote connection described by %p closed.\n",
-               events_[i].data.ptr);
-
-        if (events_[i].data.ptr != nullptr) {
-          auto *client = reinterpret_cast<RoombaClient *>(events_[i].data.ptr);
-          client->Close();
-
-          // Erase the client from our vector.
-          clients_.erase(std::remove(clients_.begin(), clients_.end(), client),
-                         clients_.end());
-          delete client;
-        }
-      } else if (events_[i].data.fd == termination_pipe_[0]) {
-        // Termination signalled.
-        return;
+        printf("Remote connection of roomba in slot %zu closed.\n",
+               client->GetSlot());
+        DropConnection(client);
       } else {
         // We've handled all other events, this one means data is waiting.
-        printf("Data waiting on socket described by %p\n", events_[i].data.ptr);
+        HandleClientData(client);
       }
     }
+
+    RunHousekeeping();
   }
-}
\ No newline at end of file
+}
+
+void RoombaServer::HandleIngressEvent(uint64_t token, uint32_t events) {
+  // The ingress drains a bounded chunk per event, so this lock is never held
+  // for a whole ring.
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  ingress_touched_.clear();
+  ingress_broadcast_ = false;
+  if (ingress_.HandleEvent(token, events, SendIngressCommand, this) == 0) {
+    return;
+  }
+
+  // A planner commits a tick's worth of commands at once, so send them as
+  // one tick. Roombas it didn't address keep whatever they have staged for
+  // the current control tick.
+  if (ingress_broadcast_) {
+    ingress_touched_ = clients_;
+  } else {
+    std::sort(ingress_touched_.begin(), ingress_touched_.end());
+    ingress_touched_.erase(
+        std::unique(ingress_touched_.begin(), ingress_touched_.end()),
+        ingress_touched_.end());
+  }
+
+  bool wake = false;
+  for (auto client : ingress_touched_) {
+    if (tick_batching_) {
+      client->Flush();
+    }
+    wake |= client->TakeReleaseRequest();
+  }
+
+  if (wake) {
+    Wake();
+  }
+}
+
+void RoombaServer::SendIngressCommand(uint16_t target, const char *id,
+                                      size_t id_len, const uint8_t *data,
+                                      size_t len, void *userdata) {
+  // Called with client_mutex_ held.
+  auto *server = static_cast<RoombaServer *>(userdata);
+  // One ingress command is one traced command, however many roombas it
+  // goes to, as with Broadcast().
+  uint64_t cmd_id = server->tracer_.Sample();
+  if (target == kShmTargetBroadcast) {
+    for (auto client : server->clients_) {
+      client->Send(data, len, cmd_id);
+    }
+    server->ingress_broadcast_ = true;
+    return;
+  }
+
+  RoombaClient *client = nullptr;
+  if (target == kShmTargetId) {
+    client = server->FindClientById(std::string(id, id_len));
+  } else if (target < server->clients_by_slot_.size()) {
+    client = server->clients_by_slot_[target];
+  }
+
+  if (client != nullptr) {
+    client->Send(data, len, cmd_id);
+    server->ingress_touched_.push_back(client);
+  }
+}
+
+void RoombaServer::AcceptClients() {
+  // Loop and connect until we run out of new clients.
+  while (1) {
+    sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    int sock = accept(listen_socket_, (sockaddr *)&client_addr, &client_len);
+    if (sock < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        // We've finished processing incoming connections.
+        break;
+      } else {
+        printf("Error on accept! errno = %s\n", strerror(errno));
+        break;
+      }
+    }
+
+    SetBlocking(sock, 0);
+
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXHOST];
+    int status = getnameinfo((const sockaddr *)&client_addr, client_len, hbuf,
+                             sizeof(hbuf), sbuf, sizeof(sbuf),
+                             NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status == 0) {
+      printf("New connection accepted from %s:%s\n", hbuf, sbuf);
+    } else {
+      printf("New connection accepted!\n");
+    }
+
+    // A mapped address identifies the roomba right away.
+    std::string id = identity_map_.Resolve(client_addr);
+    RoombaClient *existing = id.empty() ? nullptr : FindClientById(id);
+    if (existing != nullptr) {
+      ResumeSession(existing, sock, false);
+      continue;
+    }
+
+    int slot = AllocateSlot();
+    if (slot < 0) {
+      printf("Too many roombas connected, rejecting connection.\n");
+      close(sock);
+      continue;
+    }
+
+    auto *client = new RoombaClient(sock, slot, next_connection_id_++);
+    client->SetId(id);
+    ConfigurePacing(client);
+    PlaceAtStartPose(client);
+    if (!AddToEpoll(client, EPOLL_CTL_ADD)) {
+      client->Close();
+      delete client;
+      continue;
+    }
+
+    // Register the client internally.
+    AddClient(client);
+    state_store_.Write(client->GetSlot(), client->GetState());
+
+    if (id.empty() && hello_timeout_ns_ > 0) {
+      // Hold off on the start sequence until we know whether this is a
+      // roomba we've seen before.
+      client->ExpectHello(NowNs() + hello_timeout_ns_);
+    } else {
+      SendStartSequence(client);
+    }
+  }
+}
+
+void RoombaServer::HandleClientData(RoombaClient *client) {
+  bool was_awaiting_hello = client->IsAwaitingHello();
+  int num_frames = client->Receive();
+  if (num_frames < 0) {
+    printf("Read failed on socket of roomba in slot %zu\n", client->GetSlot());
+    DropConnection(client);
+    return;
+  }
+
+  if (was_awaiting_hello && !client->IsAwaitingHello()) {
+    client = FinishHello(client);
+  }
+
+  if (num_frames > 0) {
+    state_store_.Write(client->GetSlot(), client->GetState());
+  }
+}
+
+void RoombaServer::SendStartSequence(RoombaClient *client) {
+  std::lock_guard<std::mutex> lock(client_mutex_);
+
+  // Put the roomba into safe mode and start its sensor stream.
+  uint8_t start[32];
+  client->Send(start, oi::EncodeStartSequence(start));
+
+  // Drive forward
+  /*
+  const char data[] = "\x89\x01\xf4\x80\x00";
+  client->Send(data, sizeof(data) - 1);
+  */
+
+  // Rotate (0x01F4 full speed, 0x0000 rotate -max)
+  const char data[] = "\x89\x01\xf4\x00\x00";
+  client->Send(data, sizeof(data) - 1);
+
+  // Don't wait for the end of the tick in batching mode.
+  client->Flush();
+}
+
+void RoombaServer::DropConnection(RoombaClient *client) {
+  if (client->GetId().empty() || grace_ns_ == 0) {
+    RemoveClient(client);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    client->Detach();
+  }
+  state_store_.Write(client->GetSlot(), client->GetState());
+  printf("Roomba %s disconnected, holding its session for %llu ms.\n",
+         client->GetId().c_str(), (unsigned long long)(grace_ns_ / 1000000));
+}
+
+RoombaClient *RoombaServer::FinishHello(RoombaClient *client) {
+  const std::string &id = client->GetHelloId();
+  if (id.empty()) {
+    SendStartSequence(client);
+    return client;
+  }
+
+  RoombaClient *existing = FindClientById(id);
+  if (existing == nullptr || existing == client) {
+    {
+      std::lock_guard<std::mutex> lock(client_mutex_);
+      client->SetId(id);
+      clients_by_id_[id] = client;
+      ConfigurePacing(client);
+      PlaceAtStartPose(client);
+    }
+    state_store_.Write(client->GetSlot(), client->GetState());
+    SendStartSequence(client);
+    return client;
+  }
+
+  // A roomba we know. Move its new connection into the old session and
+  // throw away the placeholder we created on accept.
+  int sock;
+  {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    sock = client->ReleaseSocket();
+  }
+  RemoveClient(client);
+  ResumeSession(existing, sock, true);
+  return existing;
+}
+
+void RoombaServer::ResumeSession(RoombaClient *client, int socket,
+                                 bool in_epoll) {
+  {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    if (client->IsAttached()) {
+      // The old connection is dead, we just haven't noticed yet.
+      printf("Roomba %s reconnected, dropping its stale connection.\n",
+             client->GetId().c_str());
+      client->Detach();
+    }
+
+    client->Attach(socket, next_connection_id_++);
+  }
+
+  if (!AddToEpoll(client, in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD)) {
+    std::lock_guard<std::mutex> lock(client_mutex_);
+    client->Detach();
+    return;
+  }
+
+  state_store_.Write(client->GetSlot(), client->GetState());
+  printf("Roomba %s resumed in slot %zu.\n", client->GetId().c_str(),
+         client->GetSlot());
+}
+
+RoombaClient *RoombaServer::FindClientById(const std::string &id) {
+  // Only the worker thread modifies clients_by_id_, so no lock is needed
+  // here.
+  auto it = clients_by_id_.find(id);
+  return it != clients_by_id_.end() ? it->second : nullptr;
+}
+
+void RoombaServer::RunHousekeeping() {
+  uint64_t now = NowNs();
+
+  std::vector<RoombaClient *> hello_timeouts, expired;
+  for (auto client : clients_) {
+    if (client->IsAwaitingHello() && now >= client->GetHelloDeadline()) {
+      hello_timeouts.push_back(client);
+    } else if (!client->IsAttached() &&
+               now >= client->GetDetachedAt() + grace_ns_) {
+      expired.push_back(client);
+    }
+  }
+
+  for (auto client : hello_timeouts) {
+    client->CancelHello();
+    SendStartSequence(client);
+  }
+
+  for (auto client : expired) {
+    printf("Session of roomba %s expired.\n", client->GetId().c_str());
+    RemoveClient(client);
+  }
+
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  for (auto client : clients_) {
+    if (client->GetNextReleaseTime() != 0) {
+      client->ReleaseHeld(now);
+    }
+
+    if (tracer_.IsEnabled()) {
+      client->PollAcks();
+    }
+  }
+}
+
+int RoombaServer::GetWorkerTimeoutMs() {
+  uint64_t now = NowNs();
+  uint64_t next = UINT64_MAX;
+  for (auto client : clients_) {
+    if (client->IsAwaitingHello()) {
+      next = std::min(next, client->GetHelloDeadline());
+    } else if (!client->IsAttached()) {
+      next = std::min(next, client->GetDetachedAt() + grace_ns_);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(client_mutex_);
+  for (auto client : clients_) {
+    // Release commands held by serial pacing on time.
+    uint64_t release = client->GetNextReleaseTime();
+    if (release != 0) {
+      next = std::min(next, release);
+    }
+
+    // Poll for acknowledgements of traced commands every millisecond.
+    if (tracer_.IsEnabled() && client->HasTracesInFlight()) {
+      next = std::min(next, now + 1000000);
+    }
+  }
+
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+
+  // Round up so we don't wake just before the deadline.
+  return next <= now ? 0 : int((next - now + 999999) / 1000000);
+}
+
+RoombaClient *RoombaServer::LookupClient(uint64_t token) {
+  size_t slot = size_t(token >> 32);
+  if (slot >= clients_by_slot_.size()) {
+    return nullptr;
+  }
+
+  RoombaClient *client = clients_by_slot_[slot];
+  if (client == nullptr || !client->IsAttached() ||
+      client->GetConnectionId() != uint32_t(token)) {
+    return nullptr;
+  }
+  return client;
+}
+
+bool RoombaServer::AddToEpoll(RoombaClient *client, int op) {
+  epoll_event evt;
+  evt.data.u64 = ClientToken(client);
+  evt.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+  if (epoll_ctl(efd_, op, client->GetSocket(), &evt) == -1) {
+    printf("epoll_ctl failed, errno = %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
@@ -4,35 +4,184 @@
 #include <sys/epoll.h>
 #include <cstdint>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "realtime.h"
 #include "roomba_client.h"
+#include "roomba_identity.h"
+#include "roomba_state.h"
+#include "shm_ingress.h"
+#include "trace.h"
 
 // Roomba server. This handles connections with Roombas, as well as sending
 // commands to specific Roombas.
 class RoombaServer {
  public:
+  // Serves up to |max_roombas| roombas at once; any more are turned away.
+  explicit RoombaServer(
+      size_t max_roombas = RoombaStateStore::kDefaultCapacity);
+
+  // Real-time settings for the network worker thread. Must be called before
+  // Initialize() to take effect.
+  void SetRealtimeConfig(const RealtimeConfig& config) { rt_config_ = config; }
+
+  // Roomba identity and session resume. A roomba is identified by the
+  // "HELLO <id>\n" line its bridge may send on connect (we wait up to the
+  // hello timeout for it), or otherwise by |map|. When an identified roomba
+  // reconnects within the grace period it gets its old slot, state and any
+  // queued commands back, and the start sequence isn't sent again.
+  // Unidentified roombas are forgotten as soon as they disconnect. A roomba
+  // with a start pose in |map| keeps its odometry in the shared arena frame.
+  // Must be called before Initialize() to take effect.
+  void SetIdentityMap(const RoombaIdentityMap& map) { identity_map_ = map; }
+  void SetSessionGracePeriod(uint32_t ms) {
+    grace_ns_ = uint64_t(ms) * 1000000;
+  }
+  void SetHelloTimeout(uint32_t ms) {
+    hello_timeout_ns_ = uint64_t(ms) * 1000000;
+  }
+
+  // Serial rate that commands to each roomba are paced to, modelling the
+  // link between its Wi-Fi bridge and the robot. Roombas with a model in the
+  // identity map use that model's rate instead. 0 disables pacing. Must be
+  // called before Initialize() to take effect.
+  void SetSerialBaud(uint32_t baud) { serial_baud_ = baud; }
+
+  // Accepts commands from local planner processes through shared-memory
+  // rings, handed out on the Unix socket |path| (see shm_ingress.h). Ring
+  // targets are client slots, as for Send(). Commands drained together are
+  // flushed together when tick batching is on. Must be called before
+  // Initialize(). Planners aren't handed over by a hot restart; they
+  // reconnect to the new process on the same path.
+  void SetIngressPath(const std::string& path) { ingress_path_ = path; }
+
   bool Initialize(uint16_t port);
   void Shutdown();
 
+  // Hot restart (see hot_restart.h). InitializeFromHandoff() resumes serving
+  // the listen socket and roombas handed over on |channel| by a previous
+  // process, without re-sending the start sequence. HandOff() stops serving,
+  // passes everything to the process on the other end of |channel| and waits
+  // for it to ack; only then does it let go, leaving the connections open
+  // and this server shut down. Sessions waiting for their roomba to
+  // reconnect are handed over too, keeping their grace period, and every
+  // session keeps its held commands and pacing level. If the handoff can't
+  // be sent or isn't acked, HandOff() returns false and the server keeps
+  // running. Either way it closes |channel|.
+  bool InitializeFromHandoff(int channel);
+  bool HandOff(int channel);
+  // Stops serving and closes our copies of everything without marking the
+  // roombas disconnected or removing the ingress socket file: for a new
+  // process whose ack came too late, after the old one took the fleet back.
+  void Abandon();
+
   void Broadcast(void* data, size_t len);
 
-  // Gets the number of clients at the time of this call.
+  // Sends to the roomba in client slot |slot|. Returns false if that slot is
+  // empty or the send failed.
+  bool Send(size_t slot, const void* data, size_t len);
+
+  // Sends |frames|, |num| consecutive |frame_len|-byte commands, one per client
+  // slot: frame i goes to slot i. Empty slots are skipped. Takes the client
+  // lock once for the whole batch. Returns the number of commands sent.
+  size_t SendEach(const uint8_t* frames, size_t frame_len, size_t num);
+
+  // Tick-batched send mode. While enabled, Send() and Broadcast() only stage
+  // commands per roomba, and FlushTick() (called once at the end of each
+  // control tick) writes every roomba's commands out as a single segment.
+  void SetTickBatching(bool enabled);
+  void FlushTick();
+
+  // Command tracing (see trace.h). Traces one in every |one_in_n| commands,
+  // 0 disables. Must be called before Initialize(). DumpTrace() writes the
+  // recorded spans as Chrome trace-event JSON and can be called any time.
+  void SetTraceSampling(uint32_t one_in_n) { tracer_.SetSampling(one_in_n); }
+  bool DumpTrace(const char* path) const { return tracer_.DumpJson(path); }
+
+  // Traffic counters summed over every client, including disconnected ones
+  // (whose segment counts are frozen at disconnect).
+  SendStats GetSendStats();
+
+  // Gets the number of connected clients at the time of this call. Roombas
+  // within their reconnect grace period aren't counted.
   // WARNING: The actual amount can change at any point!
   size_t GetNumClients();
 
+  // Latest sensor state of every roomba, indexed by client slot. Safe to read
+  // from any thread without locking.
+  const RoombaStateStore& GetStateStore() const { return state_store_; }
+
  private:
+  // Sets up epoll (adding the listen socket and any existing clients) and
+  // starts the worker thread.
+  bool StartWorker();
+  void StopWorker();
+  void CloseAll(bool mark_disconnected);
+
   void WorkerThreadFn();
+  void AcceptClients();
+  void HandleClientData(RoombaClient* client);
+  void HandleIngressEvent(uint64_t token, uint32_t events);
+  static void SendIngressCommand(uint16_t target, const char* id,
+                                 size_t id_len, const uint8_t* data,
+                                 size_t len, void* userdata);
+  void AddClient(RoombaClient* client);
+  void RemoveClient(RoombaClient* client);
+
+  // Session handling (see SetIdentityMap()).
+  void SendStartSequence(RoombaClient* client);
+  void ConfigurePacing(RoombaClient* client);
+  // Puts the client's odometry in the arena frame if the map has its pose.
+  void PlaceAtStartPose(RoombaClient* client);
+  void Wake();
+  void DropConnection(RoombaClient* client);
+  RoombaClient* FinishHello(RoombaClient* client);
+  void ResumeSession(RoombaClient* client, int socket, bool in_epoll);
+  RoombaClient* FindClientById(const std::string& id);
+  void RunHousekeeping();
+  int GetWorkerTimeoutMs();
+
+  // Maps an epoll token back to its client. Returns nullptr if the event is
+  // for a connection that has since been replaced.
+  RoombaClient* LookupClient(uint64_t token);
+  bool AddToEpoll(RoombaClient* client, int op);
+
+  // Returns the lowest free client slot, or -1 if the fleet is full.
+  int AllocateSlot();
 
   int efd_ = -1;
   int listen_socket_ = -1;
-  int termination_pipe_[2];
+  int termination_pipe_[2] = {-1, -1};
+  int wake_fd_ = -1;
 
   std::vector<epoll_event> events_;
   std::vector<RoombaClient*> clients_;
+  std::vector<RoombaClient*> clients_by_slot_;  // nullptr = free slot
+  std::unordered_map<std::string, RoombaClient*> clients_by_id_;
+  bool tick_batching_ = false;
+  SendStats retired_stats_;
+  RoombaStateStore state_store_;
   std::mutex client_mutex_;
   std::thread worker_thread_;
+  RealtimeConfig rt_config_;
+
+  CommandTracer tracer_;
+
+  std::string ingress_path_;
+  ShmIngress ingress_;
+  // Clients addressed by the ingress chunk being drained, and whether it
+  // broadcast. Only used under client_mutex_.
+  std::vector<RoombaClient*> ingress_touched_;
+  bool ingress_broadcast_ = false;
+
+  RoombaIdentityMap identity_map_;
+  uint64_t grace_ns_ = 10000000000ull;
+  uint64_t hello_timeout_ns_ = 250000000ull;
+  uint32_t next_connection_id_ = 1;
+  uint32_t serial_baud_ = oi::kDefaultBaud;
 };
 
 #endif  // _ROOMBA_SERVER_H_
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "roomba_state.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+static_assert(sizeof(RoombaState) % sizeof(uint64_t) == 0,
+              "RoombaState must be a whole number of 64-bit words");
+static_assert(std::is_trivially_copyable<RoombaState>::value,
+              "RoombaState is copied word by word");
+
+RoombaStateStore::RoombaStateStore(size_t capacity)
+    : capacity_(capacity), memory_(nullptr), num_used_slots_(0) {
+  // new[] doesn't honor Slot's alignment before C++17.
+  if (posix_memalign(&memory_, alignof(Slot), sizeof(Slot) * capacity_) !=
+      0) {
+    printf("Failed to allocate state for %zu roombas.\n", capacity_);
+    capacity_ = 0;
+    memory_ = nullptr;
+  }
+
+  slots_ = static_cast<Slot*>(memory_);
+  for (size_t i = 0; i < capacity_; i++) {
+    new (&slots_[i]) Slot();
+    slots_[i].seq.store(0, std::memory_order_relaxed);
+    for (size_t w = 0; w < kWords; w++) {
+      slots_[i].words[w].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+RoombaStateStore::~RoombaStateStore() {
+  // Slot is trivially destructible.
+  free(memory_);
+}
+
+void RoombaStateStore::Write(size_t slot, const RoombaState& state) {
+  if (slot >= capacity_) {
+    return;
+  }
+
+  uint64_t words[kWords];
+  std::memcpy(words, &state, sizeof(words));
+
+  // Odd sequence numbers mark a write in progress.
+  Slot& s = slots_[slot];
+  uint32_t seq = s.seq.load(std::memory_order_relaxed);
+  s.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t w = 0; w < kWords; w++) {
+    s.words[w].store(words[w], std::memory_order_relaxed);
+  }
+  s.seq.store(seq + 2, std::memory_order_release);
+
+  size_t used = num_used_slots_.load(std::memory_order_relaxed);
+  if (slot >= used) {
+    num_used_slots_.store(slot + 1, std::memory_order_release);
+  }
+}
+
+bool RoombaStateStore::ReadSlot(const Slot& slot, RoombaState* out) const {
+  uint64_t words[kWords];
+  for (int attempt = 0; attempt < kMaxReadAttempts; attempt++) {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+
+    for (size_t w = 0; w < kWords; w++) {
+      words[w] = slot.words[w].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == seq) {
+      std::memcpy(out, words, sizeof(words));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool RoombaStateStore::Read(size_t slot, RoombaState* out) const {
+  if (slot >= capacity_) {
+    return false;
+  }
+
+  return ReadSlot(slots_[slot], out) && out->connected != 0;
+}
+
+size_t RoombaStateStore::SnapshotAll(std::vector<RoombaState>* out) const {
+  size_t used = num_used_slots_.load(std::memory_order_acquire);
+  out->resize(used);
+
+  size_t num_connected = 0;
+  for (size_t i = 0; i < used; i++) {
+    // On failure the entry keeps its previous contents.
+    ReadSlot(slots_[i], &(*out)[i]);
+    if ((*out)[i].connected) {
+      num_connected++;
+    }
+  }
+
+  return num_connected;
+}
@@ -0,0 +1,89 @@
+#ifndef _ROOMBA_STATE_H_
+#define _ROOMBA_STATE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Latest known state of a single roomba, decoded from its sensor stream.
+struct RoombaState {
+  uint64_t timestamp_ns;  // NowNs() of the last update, 0 = never updated
+
+  // Odometry pose integrated from the wheel encoders, relative to where the
+  // roomba was when it connected, or in the shared arena frame if the roomba
+  // map gave its start pose (see |pose_known|).
+  float x_mm;
+  float y_mm;
+  float theta_rad;
+
+  uint16_t voltage_mv;
+  int16_t current_ma;
+  uint16_t battery_charge_mah;
+  uint16_t battery_capacity_mah;
+  uint16_t encoder_left;
+  uint16_t encoder_right;
+
+  uint8_t bumps_wheel_drops;  // raw OI packet 7
+  uint8_t connected;          // non-zero while a client owns this slot
+  uint8_t pose_known;         // non-zero if the pose is in the arena frame
+  uint8_t reserved[5];
+};
+
+// Dense array of RoombaState records indexed by client slot, sized once at
+// construction.
+//
+// Each slot is a seqlock: the network worker thread is the only writer, and
+// any number of threads can read without taking a lock or ever blocking the
+// writer. A reader only retries if it overlapped a write to the same slot,
+// which at sensor stream rates (one update per 15 ms) is vanishingly rare,
+// and gives up after kMaxReadAttempts. That keeps a reader from spinning
+// forever on a writer it has preempted (a SCHED_FIFO control loop sharing a
+// CPU with the worker, say).
+class RoombaStateStore {
+ public:
+  static const size_t kDefaultCapacity = 16384;
+
+  explicit RoombaStateStore(size_t capacity = kDefaultCapacity);
+  ~RoombaStateStore();
+
+  RoombaStateStore(const RoombaStateStore&) = delete;
+  RoombaStateStore& operator=(const RoombaStateStore&) = delete;
+
+  size_t GetCapacity() const { return capacity_; }
+
+  // Publishes |state| into |slot|. Only one thread may write a given slot.
+  void Write(size_t slot, const RoombaState& state);
+
+  // Copies a consistent snapshot of |slot| into |out|. Returns false if the
+  // slot is out of range, not currently owned by a client, or mid-write for
+  // longer than a read will wait.
+  bool Read(size_t slot, RoombaState* out) const;
+
+  // Copies every slot up to the highest one ever used into |out| (resized to
+  // match, indexed by slot) in a single linear pass. Check |connected| to see
+  // which entries are live. A slot that stays mid-write keeps the entry |out|
+  // already had for it (zeroed if new), so pass the previous snapshot back
+  // in to fall back to the last good copy. Returns the number of connected
+  // roombas.
+  size_t SnapshotAll(std::vector<RoombaState>* out) const;
+
+ private:
+  static const size_t kWords = sizeof(RoombaState) / sizeof(uint64_t);
+  static const int kMaxReadAttempts = 64;
+
+  struct alignas(64) Slot {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> words[kWords];
+  };
+
+  // Returns false if every attempt overlapped a write.
+  bool ReadSlot(const Slot& slot, RoombaState* out) const;
+
+  size_t capacity_;
+  void* memory_;  // backs |slots_|, which must be cache line aligned
+  Slot* slots_;
+  std::atomic<size_t> num_used_slots_;
+};
+
+#endif  // _ROOMBA_STATE_H_
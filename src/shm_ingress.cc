@@ -0,0 +1,326 @@
+#include "shm_ingress.h"
+
+#include "fd_passing.h"
+#include "roomba_identity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(kShmMaxIdBytes == kMaxRoombaIdLength,
+              "ingress ids must fit any roomba id");
+
+bool ShmIngress::Start(const std::string& path, int efd) {
+  efd_ = efd;
+  path_ = path;
+  if (!Listen()) {
+    efd_ = -1;
+    return false;
+  }
+
+  printf("Accepting planners on %s\n", path.c_str());
+  return true;
+}
+
+bool ShmIngress::Relisten() {
+  if (efd_ == -1) {
+    return true;
+  }
+
+  // We hold the only reference, so closing it also takes it out of epoll.
+  if (listen_socket_ != -1) {
+    close(listen_socket_);
+    listen_socket_ = -1;
+  }
+  return Listen();
+}
+
+bool ShmIngress::Listen() {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    printf("Ingress socket path %s is too long.\n", path_.c_str());
+    return false;
+  }
+  std::strcpy(addr.sun_path, path_.c_str());
+
+  listen_socket_ =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_socket_ < 0) {
+    printf("Failed to create ingress socket, errno = %s\n", strerror(errno));
+    return false;
+  }
+
+  // A previous server (crashed, or handing over to us) may have left the
+  // socket file behind.
+  unlink(path_.c_str());
+  if (bind(listen_socket_, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_socket_, 16) < 0) {
+    printf("Failed to listen on %s, errno = %s\n", path_.c_str(),
+           strerror(errno));
+    close(listen_socket_);
+    listen_socket_ = -1;
+    return false;
+  }
+
+  epoll_event evt;
+  evt.data.u64 = kTokenTag;
+  evt.events = EPOLLIN | EPOLLET;
+  if (epoll_ctl(efd_, EPOLL_CTL_ADD, listen_socket_, &evt) == -1) {
+    printf("Failed to add ingress socket to epoll list, errno = %s\n",
+           strerror(errno));
+    close(listen_socket_);
+    listen_socket_ = -1;
+    unlink(path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+void ShmIngress::Stop(bool unlink_path) {
+  while (!planners_.empty()) {
+    RemovePlanner(planners_.back());
+  }
+
+  if (listen_socket_ != -1) {
+    close(listen_socket_);
+    listen_socket_ = -1;
+    if (unlink_path && !path_.empty()) {
+      unlink(path_.c_str());
+    }
+  }
+  efd_ = -1;
+}
+
+size_t ShmIngress::HandleEvent(uint64_t token, uint32_t events, CommandFn fn,
+                               void* userdata) {
+  uint32_t id = uint32_t((token & ~kTokenTagMask) >> 1);
+  if (id == 0) {
+    AcceptPlanners();
+    return 0;
+  }
+
+  Planner* planner = FindPlanner(id);
+  if (planner == nullptr) {
+    // Stale event for a planner we've already dropped.
+    return 0;
+  }
+
+  bool doorbell = token & 1;
+  if (doorbell) {
+    uint64_t count;
+    read(planner->doorbell, &count, sizeof(count));
+  } else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+    planner->hung_up = true;
+  }
+
+  int drained = Drain(planner, kMaxDrainRecords, fn, userdata);
+  if (drained < 0) {
+    printf("Planner %u wrote a malformed record, dropping it.\n", id);
+    RemovePlanner(planner);
+    return 0;
+  }
+
+  ShmRingHeader* ring = planner->ring;
+  if (ring->head.load(std::memory_order_acquire) !=
+      ring->tail.load(std::memory_order_relaxed)) {
+    // More to drain; come back to it after whatever else is ready.
+    uint64_t one = 1;
+    write(planner->doorbell, &one, sizeof(one));
+  } else if (planner->hung_up) {
+    printf("Planner %u disconnected.\n", id);
+    RemovePlanner(planner);
+  }
+  return size_t(drained);
+}
+
+void ShmIngress::AcceptPlanners() {
+  while (true) {
+    int sock = accept4(listen_socket_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("Error accepting planner, errno = %s\n", strerror(errno));
+      }
+      break;
+    }
+
+    if (!AddPlanner(sock)) {
+      close(sock);
+    }
+  }
+}
+
+bool ShmIngress::AddPlanner(int socket) {
+  // Sealed against resizing, so a planner can't shrink the ring under us.
+  int memfd = memfd_create("roomba_ingress", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    printf("memfd_create failed, errno = %s\n", strerror(errno));
+    return false;
+  }
+
+  size_t map_size = ShmRingMapSize(kShmRingCapacity);
+  void* map = MAP_FAILED;
+  if (ftruncate(memfd, off_t(map_size)) == 0 &&
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ==
+          0) {
+    map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+               0);
+  }
+  if (map == MAP_FAILED) {
+    printf("Failed to set up planner ring, errno = %s\n", strerror(errno));
+    close(memfd);
+    return false;
+  }
+
+  auto* ring = new (map) ShmRingHeader();
+  ring->magic = kShmRingMagic;
+  ring->version = kShmRingVersion;
+  ring->capacity = kShmRingCapacity;
+  ring->head.store(0);
+  ring->tail.store(0);
+
+  Planner* planner = new Planner();
+  planner->id = next_planner_id_++;
+  planner->socket = socket;
+  planner->memfd = memfd;
+  planner->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  planner->ring = ring;
+  planner->hung_up = false;
+
+  // The planner only needs to write the ring and ring the doorbell.
+  ShmHello hello;
+  hello.magic = kShmRingMagic;
+  hello.version = kShmRingVersion;
+  hello.capacity = kShmRingCapacity;
+  hello.max_frame_bytes = kShmMaxFrameBytes;
+  int fds[2] = {memfd, planner->doorbell};
+
+  uint64_t token = kTokenTag | (uint64_t(planner->id) << 1);
+  epoll_event sock_evt;
+  sock_evt.data.u64 = token;
+  sock_evt.events = EPOLLRDHUP | EPOLLET;
+  epoll_event bell_evt;
+  bell_evt.data.u64 = token | 1;
+  bell_evt.events = EPOLLIN | EPOLLET;
+
+  if (planner->doorbell < 0 ||
+      !SendWithFds(socket, &hello, sizeof(hello), fds, 2) ||
+      epoll_ctl(efd_, EPOLL_CTL_ADD, socket, &sock_evt) == -1 ||
+      epoll_ctl(efd_, EPOLL_CTL_ADD, planner->doorbell, &bell_evt) == -1) {
+    printf("Failed to hand a ring to a new planner.\n");
+    planner->socket = -1;  // the caller closes it
+    planners_.push_back(planner);
+    RemovePlanner(planner);
+    return false;
+  }
+
+  planners_.push_back(planner);
+  printf("Planner %u connected.\n", planner->id);
+  return true;
+}
+
+void ShmIngress::RemovePlanner(Planner* planner) {
+  // The planner holds its own copy of the doorbell (and could hold one of
+  // the socket), so closing ours wouldn't take them out of the epoll set.
+  // Neither may be in it yet if we're giving up on adding the planner.
+  if (planner->socket != -1) {
+    epoll_ctl(efd_, EPOLL_CTL_DEL, planner->socket, nullptr);
+    close(planner->socket);
+  }
+  if (planner->doorbell != -1) {
+    epoll_ctl(efd_, EPOLL_CTL_DEL, planner->doorbell, nullptr);
+    close(planner->doorbell);
+  }
+  munmap(planner->ring, ShmRingMapSize(kShmRingCapacity));
+  close(planner->memfd);
+
+  planners_.erase(std::remove(planners_.begin(), planners_.end(), planner),
+                  planners_.end());
+  delete planner;
+}
+
+ShmIngress::Planner* ShmIngress::FindPlanner(uint32_t id) {
+  for (auto planner : planners_) {
+    if (planner->id == id) {
+      return planner;
+    }
+  }
+  return nullptr;
+}
+
+int ShmIngress::Drain(Planner* planner, int max_records, CommandFn fn,
+                      void* userdata) {
+  ShmRingHeader* ring = planner->ring;
+  const uint8_t* data = ShmRingData(ring);
+  const uint64_t capacity = kShmRingCapacity;
+
+  // Drain up to the head as of now; anything committed later rings again.
+  // Stopping early at |max_records| leaves the rest for the next call.
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (head - tail > capacity || (head & 3) != 0) {
+    return -1;
+  }
+
+  // The planner can scribble over the ring at any time, so every record is
+  // copied out before it's checked or used.
+  uint8_t record_data[ShmIdRecordLen(kShmMaxIdBytes, kShmMaxFrameBytes)];
+  int drained = 0;
+  while (tail != head && drained < max_records) {
+    size_t offset = size_t(tail & (capacity - 1));
+    size_t to_end = size_t(capacity - offset);
+
+    ShmRecord record;
+    std::memcpy(&record, data + offset, sizeof(record));
+    if (record.target == kShmTargetPadding) {
+      if (head - tail < to_end) {
+        return -1;
+      }
+      tail += to_end;
+      continue;
+    }
+
+    size_t size = ShmRecordSize(record.len);
+    if (record.len > sizeof(record_data) || size > to_end ||
+        size > head - tail) {
+      return -1;
+    }
+
+    std::memcpy(record_data, data + offset + sizeof(record), record.len);
+    const uint8_t* frame = record_data;
+    size_t frame_len = record.len;
+    const char* id = nullptr;
+    size_t id_len = 0;
+    if (record.target == kShmTargetId) {
+      id_len = record.len > 0 ? record_data[0] : 0;
+      if (id_len == 0 || id_len > kShmMaxIdBytes ||
+          ShmIdRecordLen(id_len, 0) > record.len) {
+        return -1;
+      }
+      id = (const char*)record_data + 1;
+      frame += ShmIdRecordLen(id_len, 0);
+      frame_len -= ShmIdRecordLen(id_len, 0);
+    }
+    if (frame_len > kShmMaxFrameBytes) {
+      return -1;
+    }
+
+    fn(record.target, id, id_len, frame, frame_len, userdata);
+    tail += size;
+    drained++;
+  }
+
+  ring->tail.store(tail, std::memory_order_release);
+  return drained;
+}
@@ -0,0 +1,96 @@
+#ifndef _SHM_INGRESS_H_
+#define _SHM_INGRESS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "shm_ring.h"
+
+// Shared-memory command ingress for planner processes on the same host.
+//
+// Planners connect to a SOCK_SEQPACKET Unix socket. Each one gets its own
+// SPSC ring (see shm_ring.h) in a memfd plus an eventfd doorbell, both passed
+// over the socket as SCM_RIGHTS. A planner writes any number of commands into
+// its ring and rings the doorbell once per batch, so submitting costs one
+// syscall per batch rather than one per command. The doorbells sit in the
+// server's epoll set; a ring is drained when its doorbell rings, and the
+// planner is dropped when its socket closes.
+//
+// Everything but Start() runs on the server's worker thread.
+class ShmIngress {
+ public:
+  // Called for every command drained from a ring. |target| is a client slot,
+  // kShmTargetBroadcast, or kShmTargetId with the roomba's id in |id|
+  // (|id_len| bytes, not NUL terminated).
+  typedef void (*CommandFn)(uint16_t target, const char* id, size_t id_len,
+                            const uint8_t* data, size_t len, void* userdata);
+
+  ~ShmIngress() { Stop(false); }
+
+  // Listens on the Unix socket |path|, replacing any stale socket file, and
+  // registers it with the epoll set |efd|.
+  bool Start(const std::string& path, int efd);
+  // Closes every ring and the listen socket. |unlink_path| removes the socket
+  // file; leave it when a successor process is taking the path over.
+  void Stop(bool unlink_path);
+
+  bool IsStarted() const { return listen_socket_ != -1; }
+  // Binds a fresh listen socket to the same path, for when another process
+  // took the path over and then gave it back (a failed hot restart). Rings
+  // already handed out keep working throughout.
+  bool Relisten();
+
+  // Whether |token| is one of ours in the shared epoll set.
+  static bool IsToken(uint64_t token) {
+    return (token & kTokenTagMask) == kTokenTag;
+  }
+
+  // Handles an epoll event for one of our tokens: accepts planners, drains a
+  // ring whose doorbell rang, or drops a planner that hung up (after
+  // draining what it left behind). Drains at most kMaxDrainRecords commands
+  // per call; if more are waiting it rings the doorbell itself, so the rest
+  // comes back as a later event and the worker can handle other sockets in
+  // between. Returns the number of commands drained.
+  size_t HandleEvent(uint64_t token, uint32_t events, CommandFn fn,
+                     void* userdata);
+
+  size_t GetNumPlanners() const { return planners_.size(); }
+
+ private:
+  // Tokens are tagged 01 in the top two bits: clients' tokens start 00 and
+  // the server's own tokens 11. The low bit picks the doorbell over the
+  // socket, the rest is the planner id (0 for the listen socket).
+  static const uint64_t kTokenTagMask = uint64_t(3) << 62;
+  static const uint64_t kTokenTag = uint64_t(1) << 62;
+
+  static const int kMaxDrainRecords = 256;
+
+  struct Planner {
+    uint32_t id;
+    int socket;
+    int memfd;
+    int doorbell;
+    ShmRingHeader* ring;
+    bool hung_up;  // dropped once its ring is drained
+  };
+
+  bool Listen();
+  void AcceptPlanners();
+  bool AddPlanner(int socket);
+  void RemovePlanner(Planner* planner);
+  Planner* FindPlanner(uint32_t id);
+
+  // Drains up to |max_records| commands. Returns the number drained, or -1
+  // if the ring is corrupt.
+  int Drain(Planner* planner, int max_records, CommandFn fn, void* userdata);
+
+  int efd_ = -1;
+  int listen_socket_ = -1;
+  std::string path_;
+  std::vector<Planner*> planners_;
+  uint32_t next_planner_id_ = 1;
+};
+
+#endif  // _SHM_INGRESS_H_
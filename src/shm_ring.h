@@ -0,0 +1,84 @@
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Shared-memory command ring between one planner process (the producer) and
+// the MasterServer (the consumer). See shm_ingress.h for how planners get a
+// ring, and ingress/roomba_ingress.h for the planner side.
+//
+// The ring lives in a memfd: a ShmRingHeader followed by |capacity| bytes of
+// records. |head| and |tail| are free-running byte counts; the planner only
+// writes |head| and the records between them, the server only writes |tail|.
+// A record is a ShmRecord followed by |len| bytes of OI frame, padded to a
+// multiple of 4 bytes. Records for kShmTargetId carry the roomba's id in
+// front of the frame: one length byte, then the id (see ShmIdRecordLen()).
+// Slots are reused as roombas come and go, so a planner that knows its
+// roombas by id should address them that way. A record never wraps: if one doesn't fit before the
+// end of the ring, the planner fills the rest with a padding record and
+// starts again at offset 0.
+//
+// The server never trusts the ring's contents; a malformed record drops the
+// planner.
+
+const uint32_t kShmRingMagic = 0x524d4252;  // "RMBR"
+const uint32_t kShmRingVersion = 2;
+
+// Bytes of record space per ring. Must be a power of two.
+const uint32_t kShmRingCapacity = 1 << 20;
+
+// Longest OI frame a record can carry.
+const uint16_t kShmMaxFrameBytes = 128;
+// Longest roomba id a kShmTargetId record can carry (kMaxRoombaIdLength).
+const uint16_t kShmMaxIdBytes = 31;
+
+// Record targets besides client slots.
+const uint16_t kShmTargetBroadcast = 0xffff;  // every roomba
+const uint16_t kShmTargetPadding = 0xfffe;    // skip to the end of the ring
+const uint16_t kShmTargetId = 0xfffd;         // the roomba named in the record
+
+struct ShmRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t reserved;
+
+  // Kept on separate cache lines so the two processes don't false-share.
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+struct ShmRecord {
+  uint16_t target;  // client slot, or one of the kShmTarget* values
+  uint16_t len;     // bytes following this header
+};
+
+// |len| of a kShmTargetId record for an |id_len|-byte id and a |frame_len|
+// byte frame.
+constexpr size_t ShmIdRecordLen(size_t id_len, size_t frame_len) {
+  return 1 + id_len + frame_len;
+}
+
+// Sent with the ring's memfd and doorbell eventfd when a planner connects.
+struct ShmHello {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t max_frame_bytes;
+};
+
+inline size_t ShmRecordSize(size_t len) {
+  return (sizeof(ShmRecord) + len + 3) & ~size_t(3);
+}
+
+inline size_t ShmRingMapSize(uint32_t capacity) {
+  return sizeof(ShmRingHeader) + capacity;
+}
+
+inline uint8_t* ShmRingData(ShmRingHeader* header) {
+  return reinterpret_cast<uint8_t*>(header) + sizeof(ShmRingHeader);
+}
+
+#endif  // _SHM_RING_H_
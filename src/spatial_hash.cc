@@ -0,0 +1,93 @@
+#include "spatial_hash.h"
+
+#include <cmath>
+
+int32_t SpatialHash::CellOf(float v) const {
+  return int32_t(std::floor(v * inv_cell_size_));
+}
+
+uint32_t SpatialHash::Bucket(int32_t cell_x, int32_t cell_y) const {
+  return ((uint32_t(cell_x) * 73856093u) ^ (uint32_t(cell_y) * 19349663u)) &
+         bucket_mask_;
+}
+
+void SpatialHash::Build(const float* x, const float* y, size_t n,
+                        float cell_size) {
+  inv_cell_size_ = 1.0f / cell_size;
+
+  // About two buckets per point keeps collisions between cells rare.
+  uint32_t num_buckets = 1;
+  while (num_buckets < 2 * n) {
+    num_buckets <<= 1;
+  }
+  bucket_mask_ = num_buckets - 1;
+
+  bucket_start_.assign(num_buckets + 1, 0);
+  point_bucket_.resize(n);
+  entries_.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t bucket = Bucket(CellOf(x[i]), CellOf(y[i]));
+    point_bucket_[i] = bucket;
+    bucket_start_[bucket + 1]++;
+  }
+
+  for (uint32_t b = 0; b < num_buckets; b++) {
+    bucket_start_[b + 1] += bucket_start_[b];
+  }
+
+  // Scatter, using bucket_start_[b] as bucket b's insertion cursor. This
+  // leaves every start shifted along by one bucket, which the loop after
+  // undoes.
+  for (size_t i = 0; i < n; i++) {
+    Entry& entry = entries_[bucket_start_[point_bucket_[i]]++];
+    entry.x = x[i];
+    entry.y = y[i];
+    entry.cell_x = CellOf(x[i]);
+    entry.cell_y = CellOf(y[i]);
+    entry.index = uint32_t(i);
+  }
+
+  for (uint32_t b = num_buckets; b > 0; b--) {
+    bucket_start_[b] = bucket_start_[b - 1];
+  }
+  bucket_start_[0] = 0;
+}
+
+size_t SpatialHash::QueryRadius(float x, float y, float radius,
+                                std::vector<uint32_t>* out) const {
+  if (entries_.empty()) {
+    return 0;
+  }
+
+  size_t found = 0;
+  float radius_sq = radius * radius;
+  int32_t min_x = CellOf(x - radius);
+  int32_t max_x = CellOf(x + radius);
+  int32_t min_y = CellOf(y - radius);
+  int32_t max_y = CellOf(y + radius);
+
+  for (int32_t cy = min_y; cy <= max_y; cy++) {
+    for (int32_t cx = min_x; cx <= max_x; cx++) {
+      uint32_t bucket = Bucket(cx, cy);
+      for (uint32_t e = bucket_start_[bucket]; e < bucket_start_[bucket + 1];
+           e++) {
+        const Entry& entry = entries_[e];
+        // Other cells can share this bucket; skip them so that no point is
+        // reported twice.
+        if (entry.cell_x != cx || entry.cell_y != cy) {
+          continue;
+        }
+
+        float dx = entry.x - x;
+        float dy = entry.y - y;
+        if (dx * dx + dy * dy <= radius_sq) {
+          out->push_back(entry.index);
+          found++;
+        }
+      }
+    }
+  }
+
+  return found;
+}
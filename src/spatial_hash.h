@@ -0,0 +1,47 @@
+#ifndef _SPATIAL_HASH_H_
+#define _SPATIAL_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Uniform-grid spatial hash over a set of 2D points, rebuilt from scratch
+// each tick. Build() buckets the points by grid cell with a counting sort
+// (O(n), no allocation once warmed up) and QueryRadius() visits only the
+// cells overlapping the query circle, so finding every robot's neighbors is
+// O(n) for a fleet of bounded density instead of all-pairs O(n^2).
+class SpatialHash {
+ public:
+  // Indexes points (x[i], y[i]) for i < n. |cell_size| should be about the
+  // radius of the queries that will be made.
+  void Build(const float* x, const float* y, size_t n, float cell_size);
+
+  // Appends the index of every point within |radius| of (x, y) to |out|,
+  // including a point at (x, y) itself. Returns the number appended.
+  size_t QueryRadius(float x, float y, float radius,
+                     std::vector<uint32_t>* out) const;
+
+  size_t GetSize() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    float x;
+    float y;
+    int32_t cell_x;
+    int32_t cell_y;
+    uint32_t index;
+  };
+
+  int32_t CellOf(float v) const;
+  uint32_t Bucket(int32_t cell_x, int32_t cell_y) const;
+
+  float inv_cell_size_ = 1.0f;
+  uint32_t bucket_mask_ = 0;
+  // Entries sorted by bucket. Bucket b is entries_[bucket_start_[b] ..
+  // bucket_start_[b + 1]).
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> bucket_start_;
+  std::vector<uint32_t> point_bucket_;
+};
+
+#endif  // _SPATIAL_HASH_H_
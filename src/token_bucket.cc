@@ -0,0 +1,61 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+
+void TokenBucket::Configure(uint32_t bytes_per_s, uint32_t burst_bytes,
+                            uint64_t now_ns) {
+  rate_ = bytes_per_s;
+  burst_ = std::max<uint32_t>(burst_bytes, 1);
+  tokens_ = double(burst_);
+  last_ns_ = now_ns;
+}
+
+void TokenBucket::Refill(uint64_t now_ns) {
+  if (now_ns <= last_ns_) {
+    return;
+  }
+
+  tokens_ += double(now_ns - last_ns_) * 1e-9 * double(rate_);
+  tokens_ = std::min(tokens_, double(burst_));
+  last_ns_ = now_ns;
+}
+
+bool TokenBucket::TryConsume(size_t bytes, uint64_t now_ns) {
+  if (rate_ == 0) {
+    return true;
+  }
+
+  Refill(now_ns);
+  double needed = std::min(double(bytes), double(burst_));
+  if (tokens_ < needed) {
+    return false;
+  }
+
+  tokens_ -= double(bytes);
+  return true;
+}
+
+uint64_t TokenBucket::GetReadyTime(size_t bytes, uint64_t now_ns) {
+  if (rate_ == 0) {
+    return now_ns;
+  }
+
+  Refill(now_ns);
+  double needed = std::min(double(bytes), double(burst_));
+  if (tokens_ >= needed) {
+    return now_ns;
+  }
+
+  // Round up so that waking at the returned time always succeeds.
+  return now_ns + uint64_t((needed - tokens_) * 1e9 / double(rate_)) + 1;
+}
+
+double TokenBucket::GetTokens(uint64_t now_ns) {
+  Refill(now_ns);
+  return tokens_;
+}
+
+void TokenBucket::SetTokens(double tokens, uint64_t now_ns) {
+  tokens_ = std::min(tokens, double(burst_));
+  last_ns_ = now_ns;
+}
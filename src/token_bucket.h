@@ -0,0 +1,37 @@
+#ifndef _TOKEN_BUCKET_H_
+#define _TOKEN_BUCKET_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Byte-granular token bucket. Tokens accrue at |rate| bytes per second up to
+// |burst| bytes.
+class TokenBucket {
+ public:
+  // A rate of 0 disables the bucket: everything is admitted immediately.
+  void Configure(uint32_t bytes_per_s, uint32_t burst_bytes, uint64_t now_ns);
+  bool IsEnabled() const { return rate_ != 0; }
+
+  // Takes |bytes| tokens if they're available. A request bigger than the
+  // whole bucket is admitted once the bucket is full, leaving it in debt.
+  bool TryConsume(size_t bytes, uint64_t now_ns);
+
+  // Returns when TryConsume(|bytes|) will next succeed (|now_ns| if it would
+  // succeed now).
+  uint64_t GetReadyTime(size_t bytes, uint64_t now_ns);
+
+  // The tokens available at |now_ns| (negative while in debt), and setting
+  // them, e.g. to carry a bucket's level over to a new one.
+  double GetTokens(uint64_t now_ns);
+  void SetTokens(double tokens, uint64_t now_ns);
+
+ private:
+  void Refill(uint64_t now_ns);
+
+  uint32_t rate_ = 0;
+  uint32_t burst_ = 0;
+  double tokens_ = 0.0;
+  uint64_t last_ns_ = 0;
+};
+
+#endif  // _TOKEN_BUCKET_H_
@@ -0,0 +1,131 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <set>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Track ids for per-roomba spans, chosen to stay clear of real thread ids.
+static const uint32_t kRoombaTrackBase = 0x40000000;
+
+static uint32_t GetThreadId() {
+  static thread_local uint32_t tid = uint32_t(syscall(SYS_gettid));
+  return tid;
+}
+
+CommandTracer::CommandTracer(size_t capacity) : capacity_(capacity) {}
+
+void CommandTracer::SetSampling(uint32_t one_in_n) {
+  if (one_in_n != 0 && !ring_) {
+    ring_.reset(new Entry[capacity_]);
+    for (size_t i = 0; i < capacity_; i++) {
+      ring_[i].seq.store(0, std::memory_order_relaxed);
+    }
+  }
+  one_in_n_ = one_in_n;
+}
+
+uint64_t CommandTracer::Sample() {
+  if (one_in_n_ == 0) {
+    return 0;
+  }
+
+  static thread_local uint32_t counter = 0;
+  if (++counter < one_in_n_) {
+    return 0;
+  }
+
+  counter = 0;
+  return next_cmd_id_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CommandTracer::Span(const char* name, uint64_t start_ns, uint64_t end_ns,
+                         uint64_t cmd_id, int slot, bool on_roomba_track) {
+  if (!ring_) {
+    return;
+  }
+
+  uint32_t track = on_roomba_track ? kRoombaTrackBase + uint32_t(slot)
+                                   : GetThreadId();
+  uint64_t words[kWords] = {
+      uint64_t(uintptr_t(name)), start_ns,
+      end_ns > start_ns ? end_ns - start_ns : 0, cmd_id,
+      (uint64_t(track) << 32) | uint32_t(slot + 1),
+  };
+
+  uint64_t index = next_index_.fetch_add(1, std::memory_order_relaxed);
+  Entry& e = ring_[index % capacity_];
+  e.seq.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t w = 0; w < kWords; w++) {
+    e.words[w].store(words[w], std::memory_order_relaxed);
+  }
+  e.seq.store(2 * index + 2, std::memory_order_release);
+}
+
+bool CommandTracer::DumpJson(const char* path) const {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    printf("Failed to open %s for the trace dump\n", path);
+    return false;
+  }
+
+  int pid = int(getpid());
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(file,
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"MasterServer\"}}",
+          pid);
+
+  std::set<int> slots;
+  uint64_t end = ring_ ? next_index_.load(std::memory_order_acquire) : 0;
+  uint64_t begin = end > capacity_ ? end - capacity_ : 0;
+  for (uint64_t index = begin; index < end; index++) {
+    const Entry& e = ring_[index % capacity_];
+
+    uint64_t words[kWords];
+    uint64_t seq = e.seq.load(std::memory_order_acquire);
+    if (seq != 2 * index + 2) {
+      // Still being written, or already overwritten by a newer span.
+      continue;
+    }
+    for (size_t w = 0; w < kWords; w++) {
+      words[w] = e.words[w].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (e.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    const char* name = (const char*)uintptr_t(words[0]);
+    uint32_t track = uint32_t(words[4] >> 32);
+    int slot = int(uint32_t(words[4])) - 1;
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"cat\":\"roomba\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+            "\"args\":{\"cmd\":%llu",
+            name, double(words[1]) / 1000.0, double(words[2]) / 1000.0, pid,
+            track, (unsigned long long)words[3]);
+    if (slot >= 0) {
+      fprintf(file, ",\"slot\":%d", slot);
+    }
+    fprintf(file, "}}");
+
+    if (track >= kRoombaTrackBase) {
+      slots.insert(slot);
+    }
+  }
+
+  for (int slot : slots) {
+    fprintf(file,
+            ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+            "\"args\":{\"name\":\"roomba slot %d\"}}",
+            pid, kRoombaTrackBase + uint32_t(slot), slot);
+  }
+
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Sampled end-to-end command tracing.
+//
+// A traced command gets an id when it enters Broadcast()/Send(), and every
+// stage it passes through records a span tagged with that id: waiting for the
+// client lock, sitting in the tick batch, the write() itself, and time in
+// flight until the kernel reports the bytes acknowledged (SIOCOUTQ). Spans go
+// into a fixed-size lock-free ring and can be dumped at any time as Chrome
+// trace-event JSON (chrome://tracing, ui.perfetto.dev). Per-roomba stages are
+// drawn on one track per client slot.
+//
+// Sampling keeps the cost low enough to leave on: untraced commands pay for
+// one thread-local counter increment.
+class CommandTracer {
+ public:
+  explicit CommandTracer(size_t capacity = 65536);
+
+  // Traces one in every |one_in_n| commands; 0 disables tracing. Must be set
+  // before any command is sent.
+  void SetSampling(uint32_t one_in_n);
+  bool IsEnabled() const { return one_in_n_ != 0; }
+
+  // Returns a fresh command id if the next command should be traced, or 0.
+  uint64_t Sample();
+
+  // Records a span on the calling thread's track, or on the track of client
+  // |slot| if |on_roomba_track| is set. |slot| < 0 means no particular client.
+  void Span(const char* name, uint64_t start_ns, uint64_t end_ns,
+            uint64_t cmd_id, int slot = -1, bool on_roomba_track = false);
+
+  // Writes everything still in the ring as trace-event JSON. Safe to call
+  // while commands are being traced.
+  bool DumpJson(const char* path) const;
+
+ private:
+  static const size_t kWords = 5;
+
+  // One ring entry. |seq| is 2 * index + 1 while being written and
+  // 2 * index + 2 once complete, so readers can skip torn or stale entries.
+  struct Entry {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[kWords];
+  };
+
+  size_t capacity_;
+  uint32_t one_in_n_ = 0;
+  std::unique_ptr<Entry[]> ring_;
+  std::atomic<uint64_t> next_index_{0};
+  std::atomic<uint64_t> next_cmd_id_{1};
+};
+
+#endif  // _TRACE_H_